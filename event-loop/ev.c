@@ -1,5 +1,8 @@
+#define _GNU_SOURCE 1
 #include <inttypes.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 enum {
     EV_READ = (1 << 0),
@@ -8,6 +11,15 @@ enum {
     EV_TIMEOUT_PERIODIC = (1 << 3),
     EV_SIGNAL = (1 << 4),
     EV_CLOEXEC = (1 << 0),
+    EV_SHARED = (1 << 1),
+};
+
+/* flags for ev_loop() */
+enum {
+    /* spin on a non-blocking epoll_wait for a bounded time before blocking */
+    EV_LOOP_BUSY_POLL = (1 << 0),
+    /* grow the epoll event array when a batch fills it completely */
+    EV_LOOP_ADAPTIVE_BATCH = (1 << 1),
 };
 
 /*
@@ -22,6 +34,20 @@ struct ev_entry;
 /**
  * ev_new - initialize a new event object, eve main data structure
  *
+ * flags is 0 or a combination of:
+ *
+ * EV_CLOEXEC - close the epoll descriptor on exec
+ *
+ * EV_SHARED - allow several threads to call ev_loop() on the object at the
+ * same time.  Entries are registered with EPOLLONESHOT, so an event is only
+ * reported to one worker, and re-armed automatically after the callback
+ * returned.  ev_entry_free() does not free the entry right away but after
+ * every worker has left the batch it may still see the entry in.  The loop
+ * ends for all workers once the last entry is removed or ev_run_out() is
+ * called.  Deferred and check callbacks run on whichever worker finishes its
+ * batch next, the low priority budget and ev_stream are not supported and
+ * EV_STATS counters are not synchronized.
+ *
  * It return the new ev object or NULL in the case of an error.
  */
 struct ev *ev_new(int flags);
@@ -42,9 +68,112 @@ int ev_add(struct ev *, struct ev_entry *);
  *
  * This function will call epoll_wait and will block until event is triggered.
  * Please call this at the end after every ev_event's are registered.
+ *
+ * flags is a combination of EV_LOOP_* values or 0:
+ *
+ * EV_LOOP_BUSY_POLL - poll the epoll set without blocking until an event
+ * shows up or the busy poll budget (see ev_busy_poll_set()) is consumed,
+ * only then block in epoll_wait.  Burns a core in exchange for a lower
+ * wakeup latency.
+ *
+ * EV_LOOP_ADAPTIVE_BATCH - start with EVE_EPOLL_ARRAY_SIZE event slots and
+ * double the array each time epoll_wait returns a full batch, up to
+ * EVE_EPOLL_ARRAY_MAX.  Drains more events per syscall for loops with
+ * many ready descriptors.
+ *
+ * Returns 0 when the loop ends or a negative errno value.
  */
 int ev_loop(struct ev *, int);
 
+/**
+ * Set the busy poll budget for EV_LOOP_BUSY_POLL
+ *
+ * usecs is the time in microseconds ev_loop() spins on a non-blocking
+ * epoll_wait before it blocks.  The default is EVE_BUSY_POLL_USECS.
+ */
+void ev_busy_poll_set(struct ev *, unsigned long usecs);
+
+/* dispatch priority classes of ev_entry objects */
+enum {
+    EV_PRIO_LOW = -1,
+    EV_PRIO_NORMAL = 0,
+    EV_PRIO_HIGH = 1,
+};
+
+/**
+ * Set the dispatch priority of an entry
+ *
+ * Within the events returned by one epoll_wait, ev_loop() calls the
+ * callbacks of EV_PRIO_HIGH entries first, then EV_PRIO_NORMAL and
+ * EV_PRIO_LOW last.  New entries are EV_PRIO_NORMAL.
+ */
+void ev_entry_priority_set(struct ev_entry *, int prio);
+
+/**
+ * Limit the number of EV_PRIO_LOW callbacks per loop iteration
+ *
+ * Ready low priority entries beyond the budget are kept back and dispatched
+ * in the following iterations, ev_loop() does not block while it holds some.
+ * This works with edge triggered entries too.  0 (the default) means no
+ * limit.
+ */
+void ev_low_priority_budget_set(struct ev *, unsigned budget);
+
+/* callback classes accounted separately by ev_stats() */
+enum {
+    EV_STATS_CB_RAW,
+    EV_STATS_CB_FD,
+    EV_STATS_CB_TIMER_ONESHOT,
+    EV_STATS_CB_TIMER_PERIODIC,
+    EV_STATS_CB_SIGNAL,
+    EV_STATS_CB_MAX,
+};
+
+#define EV_STATS_BUCKETS 32
+#define EV_STATS_SLOWEST 8
+
+/*
+ * Loop instrumentation, only collected if compiled with -DEV_STATS.
+ *
+ * All histograms are log2 histograms: bucket i counts the samples in the
+ * range [2^i, 2^(i+1)), the last bucket also takes everything larger.  Time
+ * based histograms are kept in TSC cycles, multiply with 1 / cycles_per_ns to
+ * get nano seconds.
+ */
+struct ev_stats {
+    /* TSC frequency measured over the lifetime of the ev object */
+    double cycles_per_ns;
+
+    /* number of epoll_wait returns and dispatched events */
+    unsigned long long iterations;
+    unsigned long long events;
+
+    /* time spent per callback, per callback class */
+    unsigned long long cb_cycles[EV_STATS_CB_MAX][EV_STATS_BUCKETS];
+
+    /* number of events returned per epoll_wait */
+    unsigned long long batch[EV_STATS_BUCKETS];
+
+    /* cycles from the return of epoll_wait to the end of the batch's
+     * dispatch, deferred and check callbacks included */
+    unsigned long long dispatch_cycles[EV_STATS_BUCKETS];
+
+    /* slowest callbacks seen so far, unsorted, unused slots are NULL.  The
+     * entry pointer is for identification only and may be dangling */
+    struct {
+        struct ev_entry *entry;
+        int cb_class;
+        unsigned long long ns;
+    } slowest[EV_STATS_SLOWEST];
+};
+
+/**
+ * Copy the loop instrumentation of ev into stats
+ *
+ * Returns 0 on success or -ENOTSUP if ev.c was built without EV_STATS.
+ */
+int ev_stats(struct ev *, struct ev_stats *stats);
+
 /* To end the processing loop
  *
  * Keep in mind: this will not free any memory, nor does this function call
@@ -123,9 +252,15 @@ void ev_entry_free(struct ev_entry *);
  * to the main loop automatically.  The caller is responsible to free
  * resourches afterwards with ev_entry_free()
  *
+ * slack is the tolerated delay of the expiry.  The deadline is rounded up to
+ * a multiple of slack on the monotonic clock, so all timers with the same
+ * slack that are due within one slack window fire in the same expiry pass.
+ * Pass NULL to use the default slack of the loop, see ev_timer_slack_set().
+ *
  * Warning: do not throw exceptions or call longjmp from a callback.
  */
 struct ev_entry *ev_timer_oneshot_new(struct timespec *,
+                                      const struct timespec *slack,
                                       void (*cb)(void *),
                                       void *);
 
@@ -135,6 +270,10 @@ struct ev_entry *ev_timer_oneshot_new(struct timespec *,
  * Ater timespec time the user provided callack cb is called. To end the timer
  * ev_timer_cancel() must be called. Normally followed by ev_entry_free()
  *
+ * slack works like for ev_timer_oneshot_new(), it aligns the first expiry.
+ * Periodic timers with the same slack whose period is a multiple of the slack
+ * therefore keep firing together.
+ *
  * NOTE: the first callback argument tell the number of missed events. This
  * can happen if too much work is scheduled and the even machinery cannot
  * execute fast enough. Normally you should only see 1.
@@ -144,10 +283,38 @@ struct ev_entry *ev_timer_oneshot_new(struct timespec *,
  * Returns NULL in case the case of an error
  */
 struct ev_entry *ev_timer_periodic_new(struct timespec *,
+                                       const struct timespec *slack,
                                        void (*cb)(unsigned long long missed,
                                                   void *),
                                        void *);
 
+/**
+ * Create a signal entry
+ *
+ * After ev_add() the signal signo is blocked and delivered via cb instead,
+ * the callback arguments are the signal number, the pid of the sender and
+ * data.  All signal entries of one ev object share a single signalfd, at most
+ * one entry per signal can be added.  ev_del() stops the delivery but leaves
+ * the signal blocked.  Free the entry with ev_entry_free().
+ *
+ * Warning: do not throw exceptions or call longjmp from a callback.
+ *
+ * Returns NULL in the case of an error.
+ */
+struct ev_entry *ev_signal_new(int signo,
+                               void (*cb)(uint32_t signo,
+                                          uint32_t pid,
+                                          void *),
+                               void *);
+
+/**
+ * Set the default timer slack of the loop
+ *
+ * Used for timers created with a NULL slack at the time they are added with
+ * ev_add().  The default is zero, every timer fires at its exact deadline.
+ */
+void ev_timer_slack_set(struct ev *, const struct timespec *slack);
+
 /*
  * struct ev_event * is freed by ev_timer_cancel - user provided callbacks
  * and data not - sure. So do not dereference ev_entry afterwards
@@ -157,6 +324,38 @@ struct ev_entry *ev_timer_periodic_new(struct timespec *,
  */
 int ev_timer_cancel(struct ev *, struct ev_entry *);
 
+/**
+ * Run a callback once after the current epoll_wait batch
+ *
+ * fn(arg) is called after all events of the batch being dispatched were
+ * handled, before ev_loop() polls again.  Handlers can use this to coalesce
+ * work, e.g. queue output per event and flush every socket once with
+ * writev().  Deferred callbacks are run in the order they were queued, a
+ * callback queued from a deferred callback runs after the next batch, but
+ * ev_loop() will not block until it did.
+ *
+ * Returns 0 or -ENOMEM.
+ */
+int ev_defer(struct ev *, void (*fn)(void *), void *arg);
+
+/**
+ * Register a check callback, run once at the end of every loop iteration
+ *
+ * In contrast to ev_defer() the callback stays registered until it is
+ * removed with ev_check_del().  Check callbacks run after the deferred
+ * callbacks of the same iteration.
+ *
+ * Returns 0 or -ENOMEM.
+ */
+int ev_check_add(struct ev *, void (*fn)(void *), void *arg);
+
+/**
+ * Remove a check callback registered with ev_check_add()
+ *
+ * The callback is identified by fn and arg.  Returns 0 or -ENOENT.
+ */
+int ev_check_del(struct ev *, void (*fn)(void *), void *arg);
+
 /**
  * set filedescriptor in non-blocking mode
  *
@@ -169,33 +368,225 @@ int ev_timer_cancel(struct ev *, struct ev_entry *);
  */
 int ev_set_non_blocking(int fd);
 
+/*
+ * Buffered stream on top of a non-blocking file descriptor (e.g. socket)
+ *
+ * Incoming data is read into a list of chunks, the read callback is called
+ * afterwards and consumes what it can with ev_stream_read() or
+ * ev_stream_peek()/ev_stream_consume().  Outgoing data is queued by
+ * ev_stream_write(), ev_stream_writev() and ev_stream_sendfile() and flushed
+ * once per loop iteration with writev(), file segments are transmitted with
+ * sendfile(), or splice() if the source is a pipe.  Write interest (EPOLLOUT)
+ * is only registered while the kernel does not take more data.
+ *
+ * If more than the high watermark is queued for writing, the stream stops
+ * reading until the queue shrinks to the low watermark.  Then the drain
+ * callback is called so the producer can continue.
+ */
+struct ev_stream;
+
+/**
+ * Create a stream for the non-blocking fd and register it at ev
+ *
+ * read_cb is called whenever new data was buffered, close_cb when the peer
+ * closed the connection (error 0) or an I/O error occured (negative errno).
+ * No callback is called for the stream after close_cb.  Both callbacks
+ * may call ev_stream_free().
+ *
+ * Returns NULL in the case of an error.
+ */
+struct ev_stream *ev_stream_new(struct ev *,
+                                int fd,
+                                void (*read_cb)(struct ev_stream *, void *),
+                                void (*close_cb)(struct ev_stream *,
+                                                 int error,
+                                                 void *),
+                                void *data);
+
+/**
+ * Deregister the stream and deallocate all buffers
+ *
+ * Queued, not yet written data is dropped.  Neither the fd of the stream nor
+ * file descriptors queued by ev_stream_sendfile() are closed.
+ */
+void ev_stream_free(struct ev_stream *);
+
+/**
+ * Set write watermarks and the drain callback
+ *
+ * Reading stops if more than high bytes are queued for writing, it resumes
+ * and drain_cb is called if the queue shrinks to low bytes or less.  The
+ * defaults are EVE_STREAM_HIGH_WATERMARK and EVE_STREAM_LOW_WATERMARK.
+ */
+void ev_stream_watermark_set(struct ev_stream *,
+                             size_t low,
+                             size_t high,
+                             void (*drain_cb)(struct ev_stream *, void *));
+
+/* number of buffered, not yet consumed bytes */
+size_t ev_stream_read_avail(struct ev_stream *);
+
+/**
+ * Copy up to len buffered bytes to buf and consume them
+ *
+ * Returns the number of bytes copied, 0 if nothing is buffered.
+ */
+size_t ev_stream_read(struct ev_stream *, void *buf, size_t len);
+
+/**
+ * Access the buffered data in place
+ *
+ * Returns a pointer to the first contiguous part of the read buffer and
+ * stores its length in len, NULL if nothing is buffered.  The data stays
+ * valid until ev_stream_consume() or the callback returns.
+ */
+const void *ev_stream_peek(struct ev_stream *, size_t *len);
+
+/* drop len bytes from the front of the read buffer */
+void ev_stream_consume(struct ev_stream *, size_t len);
+
+/**
+ * Queue data for writing
+ *
+ * The data is copied, the write happens at the end of the loop iteration.
+ * Returns 0, -ENOMEM or -EPIPE if the stream is already closed.
+ */
+int ev_stream_write(struct ev_stream *, const void *buf, size_t len);
+int ev_stream_writev(struct ev_stream *, const struct iovec *iov, int iovcnt);
+
+/**
+ * Queue count bytes of in_fd starting at offset for zero-copy transmission
+ *
+ * Regular files are sent with sendfile(), offset is ignored for pipes which
+ * are spliced.  While such a pipe is empty the stream waits for its writer.
+ * in_fd must stay open until the data was written or the stream was freed.
+ * Returns 0, -ENOMEM or -EPIPE.
+ */
+int ev_stream_sendfile(struct ev_stream *, int in_fd, off_t offset,
+                       size_t count);
+
+/* number of queued, not yet written bytes */
+size_t ev_stream_write_pending(struct ev_stream *);
+
+/* file descriptor of the stream */
+int ev_stream_fd(struct ev_stream *);
+
 /* Implementation starts here */
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 
 #define EVE_EPOLL_ARRAY_SIZE 64
+#define EVE_EPOLL_ARRAY_MAX 4096
+#define EVE_BUSY_POLL_USECS 50
+#define EVE_TIMER_SLACK_DEFAULT (-1LL)
+#define EVE_SIGNAL_BATCH 16
+#define EVE_RECLAIM_MS 10
+
+#define EVE_STREAM_CHUNK 16384
+#define EVE_STREAM_IOV_MAX 64
+#define EVE_STREAM_LOW_WATERMARK (64 * 1024)
+#define EVE_STREAM_HIGH_WATERMARK (1024 * 1024)
 
 struct ev {
     int fd;
     int break_loop;
     unsigned long long entries;
 
+    /* spin time of EV_LOOP_BUSY_POLL before blocking in epoll_wait */
+    unsigned long long busy_poll_ns;
+
+    /* slack of timers without their own, see ev_timer_slack_set() */
+    unsigned long long timer_slack_ns;
+
+    /* one signalfd for all EV_SIGNAL entries, registered at epoll with
+     * signal_entry, signal_table maps the signal number to its entry */
+    int signal_fd;
+    sigset_t signal_mask;
+    struct ev_entry *signal_entry;
+    struct ev_entry *signal_table[NSIG];
+
+    /* EV_PRIO_LOW events held back by the budget, ev_del() clears the
+     * data.ptr of removed entries */
+    unsigned low_budget;
+    struct epoll_event *backlog;
+    int backlog_len, backlog_cap;
+
+    /* events being dispatched, ev_del() clears them the same way */
+    struct epoll_event *batch;
+    int batch_len;
+
+    /* ev_defer() callbacks, FIFO */
+    struct ev_cb *defer_head, **defer_tail;
+
+    /* ev_check_add() callbacks, ev_check_del() only clears the fn of
+     * those removed while they are being run and they are unlinked
+     * after the walk */
+    struct ev_cb *checks;
+    int checks_running;
+
+    /* EV_SHARED: lock protects everything above except the counters, the
+     * eventfd wakes all workers up at the end. Retired entries are freed
+     * once every worker announced a newer epoch than theirs */
+    int shared;
+    pthread_mutex_t lock;
+    int wake_fd;
+    struct ev_entry *wake_entry;
+    unsigned long long epoch;
+    struct ev_worker *workers;
+    struct ev_entry *retired;
+
+    /* workers asleep without a timeout, and whether the eventfd was
+     * written to wake them for a retired entry.  The last one to wake
+     * reads it again */
+    int sleeping, poked;
+
+#ifdef EV_STATS
+    struct ev_stats stats;
+    struct {
+        struct ev_entry *entry;
+        int cb_class;
+        unsigned long long cycles;
+    } stats_slowest[EV_STATS_SLOWEST];
+    unsigned long long stats_slowest_min;
+    unsigned long long stats_tsc_start, stats_ns_start;
+#endif
+
     /* implementation specific data, e.g. select timer handling
      * will use this to store the rbtree */
     void *priv_data;
 };
 
+struct ev_cb {
+    void (*fn)(void *);
+    void *arg;
+    struct ev_cb *next;
+};
+
+/* a thread in ev_loop() of an EV_SHARED object */
+struct ev_worker {
+    /* epoch announced before epoll_wait, entries retired at this epoch or
+     * later may be referenced by the current batch */
+    unsigned long long epoch;
+    struct ev_worker *next;
+};
+
 struct ev_entry {
     /* monitored FD if type is EV_READ or EV_WRITE */
     int fd;
@@ -216,6 +607,9 @@ struct ev_entry {
     /* timeout val if type is EV_TIMEOUT_ONESHOT */
     struct timespec timespec;
 
+    /* timer slack in ns, EVE_TIMER_SLACK_DEFAULT for the loop default */
+    long long slack_ns;
+
     union {
         void (*fd_cb)(int, int, void *);
         void (*fd_cb_raw)(int, uint32_t, void *);
@@ -227,6 +621,25 @@ struct ev_entry {
     /* user provided pointer to data */
     void *data;
 
+    /* epoll events reported for the entry in the current batch */
+    uint32_t revents;
+
+    /* EV_PRIO_* dispatch class, and the backlog slot plus one of a held
+     * back EV_PRIO_LOW entry, 0 if it is not queued.  batch_slot is the
+     * same for the batch being dispatched, stale once that one is done */
+    int priority;
+    int backlog_slot;
+    int batch_slot;
+
+    /* EV_SHARED: object the entry was added to, deleted is set by ev_del()
+     * under the entry lock, so a concurrent re-arm cannot resurrect the
+     * registration. Retired entries wait for reclamation */
+    struct ev *ev;
+    int deleted;
+    char lock;
+    unsigned long long retire_epoch;
+    struct ev_entry *retire_next;
+
     /* implementation specific data (e.g. for epoll, select) */
     void *priv_data;
 };
@@ -241,12 +654,81 @@ static struct ev *struct_ev_new_internal(void)
     return ev;
 }
 
+static void ev_wake_all(struct ev *ev)
+{
+    uint64_t one = 1;
+
+    /* level triggered and never read while the loop ends, every worker
+     * returns from epoll_wait */
+    ssize_t ret = write(ev->wake_fd, &one, sizeof(one));
+    (void) ret;
+}
+
 int ev_run_out(struct ev *ev)
 {
-    ev->break_loop = 1;
+    __atomic_store_n(&ev->break_loop, 1, __ATOMIC_RELEASE);
+    if (ev->shared)
+        ev_wake_all(ev);
     return 0;
 }
 
+void ev_busy_poll_set(struct ev *ev, unsigned long usecs)
+{
+    ev->busy_poll_ns = usecs * 1000ULL;
+}
+
+static inline long long ev_timespec_to_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+void ev_timer_slack_set(struct ev *ev, const struct timespec *slack)
+{
+    ev->timer_slack_ns = slack ? ev_timespec_to_ns(slack) : 0;
+}
+
+static inline unsigned long long ev_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline void ev_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void ev_lock(struct ev *ev)
+{
+    if (ev->shared)
+        pthread_mutex_lock(&ev->lock);
+}
+
+static inline void ev_unlock(struct ev *ev)
+{
+    if (ev->shared)
+        pthread_mutex_unlock(&ev->lock);
+}
+
+/* held only around the deleted flag and the epoll_ctl call */
+static inline void ev_entry_lock(struct ev_entry *ev_entry)
+{
+    while (__atomic_test_and_set(&ev_entry->lock, __ATOMIC_ACQUIRE))
+        ev_cpu_relax();
+}
+
+static inline void ev_entry_unlock(struct ev_entry *ev_entry)
+{
+    __atomic_clear(&ev_entry->lock, __ATOMIC_RELEASE);
+}
+
 /* similar for all implementations, at least
  * under Linux. Solaris, AIX, etc. differs and need
  * a separate implementation */
@@ -263,19 +745,189 @@ int ev_set_non_blocking(int fd)
     return 0;
 }
 
+#ifdef EV_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long long ev_tsc(void)
+{
+    return __rdtsc();
+}
+#else
+static inline unsigned long long ev_tsc(void)
+{
+    return ev_now_ns();
+}
+#endif
+
+#define ev_stats_tsc() ev_tsc()
+
+static inline unsigned ev_stats_bucket(unsigned long long v)
+{
+    unsigned b = 63 - __builtin_clzll(v | 1);
+    return b < EV_STATS_BUCKETS ? b : EV_STATS_BUCKETS - 1;
+}
+
+static void ev_stats_init(struct ev *ev)
+{
+    memset(&ev->stats, 0, sizeof(ev->stats));
+    memset(ev->stats_slowest, 0, sizeof(ev->stats_slowest));
+    ev->stats_slowest_min = 0;
+    ev->stats_tsc_start = ev_tsc();
+    ev->stats_ns_start = ev_now_ns();
+}
+
+static inline int ev_stats_class(struct ev_entry *ev_entry);
+
+static inline void ev_stats_batch(struct ev *ev, int nfds)
+{
+    ev->stats.iterations++;
+    ev->stats.events += nfds;
+    ev->stats.batch[ev_stats_bucket(nfds)]++;
+}
+
+static inline void ev_stats_dispatch(struct ev *ev, unsigned long long start)
+{
+    ev->stats.dispatch_cycles[ev_stats_bucket(ev_tsc() - start)]++;
+}
+
+static inline void ev_stats_callback(struct ev *ev,
+                                     struct ev_entry *ev_entry,
+                                     int cb_class,
+                                     unsigned long long start)
+{
+    unsigned long long cycles = ev_tsc() - start;
+
+    ev->stats.cb_cycles[cb_class][ev_stats_bucket(cycles)]++;
+    if (cycles <= ev->stats_slowest_min)
+        return;
+
+    /* replace the fastest of the slowest and update the threshold */
+    int min = 0;
+    for (int i = 1; i < EV_STATS_SLOWEST; i++) {
+        if (ev->stats_slowest[i].cycles < ev->stats_slowest[min].cycles)
+            min = i;
+    }
+    ev->stats_slowest[min].entry = ev_entry;
+    ev->stats_slowest[min].cb_class = cb_class;
+    ev->stats_slowest[min].cycles = cycles;
+
+    ev->stats_slowest_min = ev->stats_slowest[0].cycles;
+    for (int i = 1; i < EV_STATS_SLOWEST; i++) {
+        if (ev->stats_slowest[i].cycles < ev->stats_slowest_min)
+            ev->stats_slowest_min = ev->stats_slowest[i].cycles;
+    }
+}
+
+int ev_stats(struct ev *ev, struct ev_stats *stats)
+{
+    unsigned long long ns = ev_now_ns() - ev->stats_ns_start;
+    unsigned long long cycles = ev_tsc() - ev->stats_tsc_start;
+
+    memcpy(stats, &ev->stats, sizeof(*stats));
+    stats->cycles_per_ns = ns ? (double) cycles / ns : 1.0;
+
+    for (int i = 0; i < EV_STATS_SLOWEST; i++) {
+        stats->slowest[i].entry = ev->stats_slowest[i].entry;
+        stats->slowest[i].cb_class = ev->stats_slowest[i].cb_class;
+        stats->slowest[i].ns =
+            ev->stats_slowest[i].cycles / stats->cycles_per_ns;
+    }
+    return 0;
+}
+#else
+#define ev_stats_tsc() 0ULL
+
+static inline void ev_stats_init(struct ev *ev)
+{
+    (void) ev;
+}
+
+static inline int ev_stats_class(struct ev_entry *ev_entry)
+{
+    (void) ev_entry;
+    return 0;
+}
+
+static inline void ev_stats_batch(struct ev *ev, int nfds)
+{
+    (void) ev;
+    (void) nfds;
+}
+
+static inline void ev_stats_dispatch(struct ev *ev, unsigned long long start)
+{
+    (void) ev;
+    (void) start;
+}
+
+static inline void ev_stats_callback(struct ev *ev,
+                                     struct ev_entry *ev_entry,
+                                     int cb_class,
+                                     unsigned long long start)
+{
+    (void) ev;
+    (void) ev_entry;
+    (void) cb_class;
+    (void) start;
+}
+
+int ev_stats(struct ev *ev, struct ev_stats *stats)
+{
+    (void) ev;
+    (void) stats;
+    return -ENOTSUP;
+}
+#endif
+
 struct ev_entry_data_epoll {
     /* std fd handling data */
     uint32_t flags;
     union {
-        sigset_t signal_mask;
+        struct {
+            sigset_t signal_mask;
+            int signo;
+        };
     };
 };
 
+static void ev_cb_list_free(struct ev_cb *cb)
+{
+    while (cb) {
+        struct ev_cb *next = cb->next;
+        free(cb);
+        cb = next;
+    }
+}
+
+static void ev_entry_destroy(struct ev_entry *ev_entry);
+
 void ev_destroy(struct ev *ev)
 {
     /* close epoll descriptor */
     close(ev->fd);
 
+    /* never run deferred callbacks are dropped */
+    ev_cb_list_free(ev->defer_head);
+    ev_cb_list_free(ev->checks);
+    free(ev->backlog);
+
+    if (ev->signal_fd >= 0) {
+        close(ev->signal_fd);
+        ev_entry_destroy(ev->signal_entry);
+    }
+
+    if (ev->shared) {
+        /* no worker left, every retired entry can go */
+        while (ev->retired) {
+            struct ev_entry *next = ev->retired->retire_next;
+            ev_entry_destroy(ev->retired);
+            ev->retired = next;
+        }
+        close(ev->wake_fd);
+        ev_entry_destroy(ev->wake_entry);
+        pthread_mutex_destroy(&ev->lock);
+    }
+
     /* clear potential secure data */
     memset(ev, 0, sizeof(struct ev));
     free(ev);
@@ -283,10 +935,57 @@ void ev_destroy(struct ev *ev)
 
 static inline int ev_new_flags_convert(int flags)
 {
-    if (flags == 0)
-        return 0;
-    if (flags == EV_CLOEXEC)
+    if (flags & ~(EV_CLOEXEC | EV_SHARED))
+        return -EINVAL;
+    if (flags & EV_CLOEXEC)
         return EPOLL_CLOEXEC;
+    return 0;
+}
+
+static void ev_wake_cb(int fd, uint32_t events, void *data)
+{
+    (void) fd;
+    (void) events;
+    (void) data;
+}
+
+/* recursive lock, callbacks run with it held may call back into the API */
+static int ev_shared_init(struct ev *ev)
+{
+    pthread_mutexattr_t attr;
+    struct epoll_event epoll_ev;
+    memset(&epoll_ev, 0, sizeof(struct epoll_event));
+
+    ev->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ev->wake_fd < 0)
+        return -EINVAL;
+
+    /* the wakeup is level triggered, without EPOLLONESHOT and it does not
+     * count as entry, it must not keep the loop alive */
+    ev->wake_entry = ev_entry_new_raw(ev->wake_fd, EPOLLIN, ev_wake_cb, ev);
+    if (!ev->wake_entry)
+        goto err_fd;
+
+    epoll_ev.events = EPOLLIN;
+    epoll_ev.data.ptr = ev->wake_entry;
+    if (epoll_ctl(ev->fd, EPOLL_CTL_ADD, ev->wake_fd, &epoll_ev) < 0)
+        goto err_entry;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    int ret = pthread_mutex_init(&ev->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0)
+        goto err_entry;
+
+    ev->epoch = 1;
+    ev->shared = 1;
+    return 0;
+
+err_entry:
+    ev_entry_destroy(ev->wake_entry);
+err_fd:
+    close(ev->wake_fd);
     return -EINVAL;
 }
 
@@ -308,6 +1007,20 @@ struct ev *ev_new(int flags)
 
     ev->entries = 0;
     ev->break_loop = 0;
+    ev->busy_poll_ns = EVE_BUSY_POLL_USECS * 1000ULL;
+    ev->defer_head = NULL;
+    ev->defer_tail = &ev->defer_head;
+    ev->checks = NULL;
+    ev->checks_running = 0;
+    ev->signal_fd = -1;
+    sigemptyset(&ev->signal_mask);
+    ev_stats_init(ev);
+
+    if ((flags & EV_SHARED) && ev_shared_init(ev) < 0) {
+        close(ev->fd);
+        free(ev);
+        return NULL;
+    }
     return ev;
 }
 
@@ -350,7 +1063,15 @@ struct ev_entry *ev_entry_new_raw(int fd,
     return ev_entry;
 }
 
+static inline long long ev_timer_slack_convert(const struct timespec *slack)
+{
+    if (!slack)
+        return EVE_TIMER_SLACK_DEFAULT;
+    return ev_timespec_to_ns(slack);
+}
+
 struct ev_entry *ev_timer_oneshot_new(struct timespec *timespec,
+                                      const struct timespec *slack,
                                       void (*cb)(void *),
                                       void *data)
 {
@@ -362,12 +1083,14 @@ struct ev_entry *ev_timer_oneshot_new(struct timespec *timespec,
     ev_entry->data = data;
     ev_entry->timer_cb_oneshot = cb;
     ev_entry->raw = 0;
+    ev_entry->slack_ns = ev_timer_slack_convert(slack);
 
     memcpy(&ev_entry->timespec, timespec, sizeof(struct timespec));
     return ev_entry;
 }
 
 struct ev_entry *ev_timer_periodic_new(struct timespec *timespec,
+                                       const struct timespec *slack,
                                        void (*cb)(unsigned long long, void *),
                                        void *data)
 {
@@ -379,6 +1102,7 @@ struct ev_entry *ev_timer_periodic_new(struct timespec *timespec,
     ev_entry->data = data;
     ev_entry->timer_cb_periodic = cb;
     ev_entry->raw = 0;
+    ev_entry->slack_ns = ev_timer_slack_convert(slack);
 
     memcpy(&ev_entry->timespec, timespec, sizeof(struct timespec));
     return ev_entry;
@@ -389,12 +1113,7 @@ static void ev_entry_timer_free(struct ev_entry *ev_entry)
     close(ev_entry->fd);
 }
 
-static void ev_entry_signal_free(struct ev_entry *ev_entry)
-{
-    close(ev_entry->fd);
-}
-
-void ev_entry_free(struct ev_entry *ev_entry)
+static void ev_entry_destroy(struct ev_entry *ev_entry)
 {
     if (ev_entry->raw)
         goto out;
@@ -404,9 +1123,6 @@ void ev_entry_free(struct ev_entry *ev_entry)
     case EV_TIMEOUT_PERIODIC:
         ev_entry_timer_free(ev_entry);
         break;
-    case EV_SIGNAL:
-        ev_entry_signal_free(ev_entry);
-        break;
     default:
         // other events have no special cleaning
         // functions. do nothing
@@ -419,26 +1135,111 @@ out:
     free(ev_entry);
 }
 
-static int ev_arm_timerfd_oneshot(struct ev_entry *ev_entry)
+/* another worker may still dispatch the entry, park it until every worker
+ * announced a newer epoch. The timer fd stays open meanwhile, so its number
+ * cannot be reused under the feet of a pending re-arm */
+static void ev_entry_retire(struct ev *ev, struct ev_entry *ev_entry)
 {
-    struct timespec now;
-    struct itimerspec new_value;
-    struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
-
-    memset(&new_value, 0, sizeof(struct itimerspec));
+    ev_lock(ev);
+    ev_entry->retire_epoch =
+        __atomic_fetch_add(&ev->epoch, 1, __ATOMIC_SEQ_CST);
+    ev_entry->retire_next = ev->retired;
+    __atomic_store_n(&ev->retired, ev_entry, __ATOMIC_RELEASE);
+
+    /* a worker asleep holds it back until it announces a newer epoch */
+    if (ev->sleeping && !ev->poked) {
+        ev->poked = 1;
+        ev_wake_all(ev);
+    }
+    ev_unlock(ev);
+}
 
-    int ret = clock_gettime(CLOCK_MONOTONIC, &now);
-    if (ret < 0)
+void ev_entry_free(struct ev_entry *ev_entry)
+{
+    if (ev_entry->ev && ev_entry->ev->shared) {
+        ev_entry_retire(ev_entry->ev, ev_entry);
+        return;
+    }
+    ev_entry_destroy(ev_entry);
+}
+
+/* free retired entries no worker can reference anymore */
+static void ev_reclaim(struct ev *ev)
+{
+    if (!__atomic_load_n(&ev->retired, __ATOMIC_ACQUIRE))
+        return;
+
+    ev_lock(ev);
+    unsigned long long min = __atomic_load_n(&ev->epoch, __ATOMIC_SEQ_CST);
+    for (struct ev_worker *w = ev->workers; w; w = w->next) {
+        unsigned long long epoch = __atomic_load_n(&w->epoch, __ATOMIC_SEQ_CST);
+        if (epoch < min)
+            min = epoch;
+    }
+
+    struct ev_entry **pe = &ev->retired;
+    while (*pe) {
+        struct ev_entry *ev_entry = *pe;
+        if (ev_entry->retire_epoch >= min) {
+            pe = &ev_entry->retire_next;
+            continue;
+        }
+        __atomic_store_n(pe, ev_entry->retire_next, __ATOMIC_RELEASE);
+        ev_entry_destroy(ev_entry);
+    }
+    ev_unlock(ev);
+}
+
+static inline unsigned long long ev_timer_slack(struct ev *ev,
+                                                struct ev_entry *ev_entry)
+{
+    if (ev_entry->slack_ns == EVE_TIMER_SLACK_DEFAULT)
+        return ev->timer_slack_ns;
+    return ev_entry->slack_ns;
+}
+
+/* absolute CLOCK_MONOTONIC expiry of ev_entry->timespec from now, rounded
+ * up to the next multiple of the slack. Timers due in the same slack window
+ * get the very same expiry and are reported by one epoll_wait */
+static int ev_timer_deadline(struct ev *ev,
+                             struct ev_entry *ev_entry,
+                             struct timespec *deadline)
+{
+    struct timespec now;
+    unsigned long long slack = ev_timer_slack(ev, ev_entry);
+
+    int ret = clock_gettime(CLOCK_MONOTONIC, &now);
+    if (ret < 0)
         return -EINVAL;
 
-    new_value.it_value.tv_sec = now.tv_sec + ev_entry->timespec.tv_sec;
-    new_value.it_value.tv_nsec = now.tv_nsec + ev_entry->timespec.tv_nsec;
+    deadline->tv_sec = now.tv_sec + ev_entry->timespec.tv_sec;
+    deadline->tv_nsec = now.tv_nsec + ev_entry->timespec.tv_nsec;
 
     /* timerfd_settime() cannot handle larger nsecs - catch overflow */
-    if (new_value.it_value.tv_nsec >= 1000000000) {
-        new_value.it_value.tv_sec++;
-        new_value.it_value.tv_nsec -= 1000000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+
+    if (slack > 1) {
+        unsigned long long ns = ev_timespec_to_ns(deadline);
+        ns = (ns + slack - 1) / slack * slack;
+        deadline->tv_sec = ns / 1000000000;
+        deadline->tv_nsec = ns % 1000000000;
     }
+    return 0;
+}
+
+static int ev_arm_timerfd_oneshot(struct ev *ev, struct ev_entry *ev_entry)
+{
+    struct itimerspec new_value;
+    struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+
+    memset(&new_value, 0, sizeof(struct itimerspec));
+
+    int ret = ev_timer_deadline(ev, ev_entry, &new_value.it_value);
+    if (ret < 0)
+        return -EINVAL;
 
     new_value.it_interval.tv_sec = 0;
     new_value.it_interval.tv_nsec = 0;
@@ -464,7 +1265,7 @@ static int ev_arm_timerfd_oneshot(struct ev_entry *ev_entry)
     return 0;
 }
 
-static int ev_arm_timerfd_periodic(struct ev_entry *ev_entry)
+static int ev_arm_timerfd_periodic(struct ev *ev, struct ev_entry *ev_entry)
 {
     struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
     struct itimerspec new_value = {
@@ -473,12 +1274,20 @@ static int ev_arm_timerfd_periodic(struct ev_entry *ev_entry)
         .it_interval.tv_sec = ev_entry->timespec.tv_sec,
         .it_interval.tv_nsec = ev_entry->timespec.tv_nsec,
     };
+    int settime_flags = 0;
+
+    /* with slack the first expiry is aligned, the interval is kept */
+    if (ev_timer_slack(ev, ev_entry) > 1) {
+        if (ev_timer_deadline(ev, ev_entry, &new_value.it_value) < 0)
+            return -EINVAL;
+        settime_flags = TFD_TIMER_ABSTIME;
+    }
 
     int fd = timerfd_create(CLOCK_MONOTONIC, 0);
     if (fd < 0)
         return -EINVAL;
 
-    int ret = timerfd_settime(fd, 0, &new_value, NULL);
+    int ret = timerfd_settime(fd, settime_flags, &new_value, NULL);
     if (ret < 0) {
         close(fd);
         return -EINVAL;
@@ -495,30 +1304,136 @@ static int ev_arm_timerfd_periodic(struct ev_entry *ev_entry)
     return 0;
 }
 
-static int ev_arm_signal(struct ev_entry *ev_entry)
+struct ev_entry *ev_signal_new(int signo,
+                               void (*cb)(uint32_t, uint32_t, void *),
+                               void *data)
+{
+    if (signo <= 0 || signo >= NSIG)
+        return NULL;
+
+    struct ev_entry *ev_entry = ev_entry_new_epoll_internal();
+    if (!ev_entry)
+        return NULL;
+
+    ev_entry->fd = -1;
+    ev_entry->type = EV_SIGNAL;
+    ev_entry->data = data;
+    ev_entry->signal_cb = cb;
+    ev_entry->raw = 0;
+
+    struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+    sigemptyset(&ev_entry_data_epoll->signal_mask);
+    sigaddset(&ev_entry_data_epoll->signal_mask, signo);
+    ev_entry_data_epoll->signo = signo;
+
+    return ev_entry;
+}
+
+/* point the shared signalfd to mask, the first call creates the signalfd
+ * and registers it at epoll. The internal entry is not accounted in
+ * ev->entries, it must not keep the loop alive */
+static int ev_signalfd_update(struct ev *ev, sigset_t *mask)
+{
+    int fd = signalfd(ev->signal_fd, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return -EINVAL;
+
+    if (ev->signal_fd < 0) {
+        struct epoll_event epoll_ev;
+        memset(&epoll_ev, 0, sizeof(struct epoll_event));
+
+        struct ev_entry *ev_entry = ev_entry_new_epoll_internal();
+        if (!ev_entry) {
+            close(fd);
+            return -ENOMEM;
+        }
+        ev_entry->fd = fd;
+        ev_entry->type = EV_SIGNAL;
+        ev_entry->data = ev;
+        ev_entry->ev = ev;
+
+        struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+        ev_entry_data_epoll->flags = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP;
+
+        epoll_ev.events = ev_entry_data_epoll->flags;
+        epoll_ev.data.ptr = ev_entry;
+        if (ev->shared)
+            epoll_ev.events |= EPOLLONESHOT;
+        if (epoll_ctl(ev->fd, EPOLL_CTL_ADD, fd, &epoll_ev) < 0) {
+            ev_entry_destroy(ev_entry);
+            close(fd);
+            return -EINVAL;
+        }
+
+        ev->signal_fd = fd;
+        ev->signal_entry = ev_entry;
+    }
+
+    ev->signal_mask = *mask;
+    return 0;
+}
+
+static int ev_arm_signal(struct ev *ev, struct ev_entry *ev_entry)
 {
     struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+    int signo = ev_entry_data_epoll->signo;
+    sigset_t mask = ev->signal_mask;
+
+    if (ev->signal_table[signo])
+        return -EBUSY;
 
     int ret = sigprocmask(SIG_BLOCK, &ev_entry_data_epoll->signal_mask, NULL);
     if (ret < 0)
         return -EINVAL;
 
-    int fd = signalfd(-1, &ev_entry_data_epoll->signal_mask, SFD_CLOEXEC);
-    if (fd < 0)
-        return -EINVAL;
+    sigaddset(&mask, signo);
+    ret = ev_signalfd_update(ev, &mask);
+    if (ret < 0)
+        return ret;
 
-    ret = ev_set_non_blocking(fd);
-    if (ret < 0) {
-        close(fd);
+    ev->signal_table[signo] = ev_entry;
+    return 0;
+}
+
+/* the signal stays blocked, pending instances are not lost this way */
+static int ev_disarm_signal(struct ev *ev, struct ev_entry *ev_entry)
+{
+    struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+    int signo = ev_entry_data_epoll->signo;
+    sigset_t mask = ev->signal_mask;
+
+    if (ev->signal_table[signo] != ev_entry)
         return -EINVAL;
-    }
 
-    ev_entry_data_epoll->flags = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP;
-    ev_entry->fd = fd;
+    sigdelset(&mask, signo);
+    int ret = ev_signalfd_update(ev, &mask);
+    if (ret < 0)
+        return ret;
+
+    ev->signal_table[signo] = NULL;
+    __atomic_store_n(&ev_entry->deleted, 1, __ATOMIC_RELEASE);
     return 0;
 }
 
-int ev_add(struct ev *ev, struct ev_entry *ev_entry)
+/* the loop may have been told to end by the previous last entry */
+static void ev_entries_inc(struct ev *ev)
+{
+    if (__atomic_fetch_add(&ev->entries, 1, __ATOMIC_SEQ_CST) == 0 &&
+        ev->shared) {
+        uint64_t val;
+        ssize_t ret = read(ev->wake_fd, &val, sizeof(val));
+        (void) ret;
+    }
+}
+
+static void ev_entries_dec(struct ev *ev)
+{
+    if (__atomic_sub_fetch(&ev->entries, 1, __ATOMIC_SEQ_CST) == 0 &&
+        ev->shared)
+        ev_wake_all(ev);
+}
+
+static int ev_add_internal(struct ev *ev, struct ev_entry *ev_entry)
 {
     int ret;
     struct epoll_event epoll_ev;
@@ -533,20 +1448,22 @@ int ev_add(struct ev *ev, struct ev_entry *ev_entry)
 
     switch (ev_entry->type) {
     case EV_TIMEOUT_ONESHOT:
-        ret = ev_arm_timerfd_oneshot(ev_entry);
+        ret = ev_arm_timerfd_oneshot(ev, ev_entry);
         if (ret != 0)
             return -EINVAL;
         break;
     case EV_TIMEOUT_PERIODIC:
-        ret = ev_arm_timerfd_periodic(ev_entry);
+        ret = ev_arm_timerfd_periodic(ev, ev_entry);
         if (ret != 0)
             return -EINVAL;
         break;
     case EV_SIGNAL:
-        ret = ev_arm_signal(ev_entry);
+        ret = ev_arm_signal(ev, ev_entry);
         if (ret != 0)
             return -EINVAL;
-        break;
+        /* delivered via the shared signalfd, nothing to add to epoll */
+        ev_entries_inc(ev);
+        return 0;
     default:
         // no special treatment of other entries
         break;
@@ -556,25 +1473,128 @@ out:
     /* FIXME: the mapping must be a one to one mapping */
     epoll_ev.events = ev_entry_data_epoll->flags;
     epoll_ev.data.ptr = ev_entry;
+    if (ev->shared)
+        epoll_ev.events |= EPOLLONESHOT;
 
     ret = epoll_ctl(ev->fd, EPOLL_CTL_ADD, ev_entry->fd, &epoll_ev);
     if (ret < 0)
         return -EINVAL;
 
-    ev->entries++;
+    ev_entries_inc(ev);
     return 0;
 }
 
-int ev_del(struct ev *ev, struct ev_entry *ev_entry)
+int ev_add(struct ev *ev, struct ev_entry *ev_entry)
+{
+    ev_entry->ev = ev;
+    __atomic_store_n(&ev_entry->deleted, 0, __ATOMIC_RELEASE);
+
+    ev_lock(ev);
+    int ret = ev_add_internal(ev, ev_entry);
+    ev_unlock(ev);
+    return ret;
+}
+
+void ev_entry_priority_set(struct ev_entry *ev_entry, int prio)
+{
+    if (prio < EV_PRIO_LOW)
+        prio = EV_PRIO_LOW;
+    if (prio > EV_PRIO_HIGH)
+        prio = EV_PRIO_HIGH;
+    ev_entry->priority = prio;
+}
+
+void ev_low_priority_budget_set(struct ev *ev, unsigned budget)
+{
+    ev->low_budget = budget;
+}
+
+/* a removed entry must not be dispatched from the backlog or the rest of
+ * the current batch later on */
+static void ev_backlog_forget(struct ev *ev, struct ev_entry *ev_entry)
+{
+    if (ev_entry->backlog_slot) {
+        ev->backlog[ev_entry->backlog_slot - 1].data.ptr = NULL;
+        ev_entry->backlog_slot = 0;
+    }
+    int slot = ev_entry->batch_slot;
+    if (slot && slot <= ev->batch_len &&
+        ev->batch[slot - 1].data.ptr == ev_entry)
+        ev->batch[slot - 1].data.ptr = NULL;
+    ev_entry->batch_slot = 0;
+}
+
+static int ev_del_internal(struct ev *ev, struct ev_entry *ev_entry)
 {
     struct epoll_event epoll_ev;
     memset(&epoll_ev, 0, sizeof(struct epoll_event));
 
+    ev_backlog_forget(ev, ev_entry);
+
+    if (!ev_entry->raw && ev_entry->type == EV_SIGNAL) {
+        if (ev_disarm_signal(ev, ev_entry) < 0)
+            return -EINVAL;
+        ev_entries_dec(ev);
+        return 0;
+    }
+
+    ev_entry_lock(ev_entry);
     int ret = epoll_ctl(ev->fd, EPOLL_CTL_DEL, ev_entry->fd, &epoll_ev);
+    if (ret == 0)
+        __atomic_store_n(&ev_entry->deleted, 1, __ATOMIC_RELEASE);
+    ev_entry_unlock(ev_entry);
+    if (ret < 0)
+        return -EINVAL;
+
+    ev_entries_dec(ev);
+    return 0;
+}
+
+int ev_del(struct ev *ev, struct ev_entry *ev_entry)
+{
+    ev_lock(ev);
+    int ret = ev_del_internal(ev, ev_entry);
+    ev_unlock(ev);
+    return ret;
+}
+
+/* EV_SHARED: give the entry back to epoll after its callback returned,
+ * unless it was removed meanwhile */
+static void ev_rearm(struct ev *ev, struct ev_entry *ev_entry)
+{
+    struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+    struct epoll_event epoll_ev;
+    memset(&epoll_ev, 0, sizeof(struct epoll_event));
+
+    epoll_ev.events = ev_entry_data_epoll->flags | EPOLLONESHOT;
+    epoll_ev.data.ptr = ev_entry;
+
+    ev_entry_lock(ev_entry);
+    if (!__atomic_load_n(&ev_entry->deleted, __ATOMIC_ACQUIRE))
+        epoll_ctl(ev->fd, EPOLL_CTL_MOD, ev_entry->fd, &epoll_ev);
+    ev_entry_unlock(ev_entry);
+}
+
+/* change the epoll events of a registered raw entry */
+static int ev_mod_internal(struct ev *ev,
+                           struct ev_entry *ev_entry,
+                           uint32_t events)
+{
+    struct ev_entry_data_epoll *ev_entry_data_epoll = ev_entry->priv_data;
+    struct epoll_event epoll_ev;
+    memset(&epoll_ev, 0, sizeof(struct epoll_event));
+
+    epoll_ev.events = events;
+    epoll_ev.data.ptr = ev_entry;
+    if (ev->shared)
+        epoll_ev.events |= EPOLLONESHOT;
+
+    int ret = epoll_ctl(ev->fd, EPOLL_CTL_MOD, ev_entry->fd, &epoll_ev);
     if (ret < 0)
         return -EINVAL;
 
-    ev->entries--;
+    ev_entry_data_epoll->flags = events;
+    ev_entry->type_raw = events;
     return 0;
 }
 
@@ -617,22 +1637,70 @@ static inline void ev_process_timer_periodic(struct ev_entry *ev_entry)
     ev_entry->timer_cb_periodic(missed, ev_entry->data);
 }
 
-static inline void ev_process_signal(struct ev_entry *ev_entry)
+/* drain the shared signalfd and dispatch every record to the entry
+ * registered for the signal number */
+static inline void ev_process_signal(struct ev *ev, struct ev_entry *ev_entry)
 {
-    struct signalfd_siginfo sigsiginfo;
+    struct signalfd_siginfo sigsiginfo[EVE_SIGNAL_BATCH];
+    struct ev_entry *due[EVE_SIGNAL_BATCH];
 
-    /* and now: cleanup timer specific data and
-     * finally all event specific data */
-    ssize_t ret = read(ev_entry->fd, &sigsiginfo, sizeof(sigsiginfo));
-    if (ret < 0) {
-        assert(0);
-        return;
+    for (;;) {
+        ssize_t ret = read(ev_entry->fd, sigsiginfo, sizeof(sigsiginfo));
+        if (ret < 0) {
+            assert(errno == EAGAIN || errno == EINTR);
+            break;
+        }
+
+        /* the lock only keeps the table stable for the lookup, a slow
+         * handler must not stall ev_add()/ev_del() of other workers */
+        int n = ret / sizeof(sigsiginfo[0]);
+        ev_lock(ev);
+        for (int i = 0; i < n; i++) {
+            uint32_t signo = sigsiginfo[i].ssi_signo;
+            due[i] = signo < NSIG ? ev->signal_table[signo] : NULL;
+        }
+        ev_unlock(ev);
+
+        for (int i = 0; i < n; i++) {
+            struct ev_entry *sig_entry = due[i];
+            uint32_t signo = sigsiginfo[i].ssi_signo;
+
+            /* an earlier callback can ev_del() it.  In EV_SHARED the
+             * memory stays valid until reclaimed and only the flag tells,
+             * otherwise it may be freed already */
+            if (!sig_entry)
+                continue;
+            if (ev->shared ? __atomic_load_n(&sig_entry->deleted,
+                                             __ATOMIC_ACQUIRE)
+                           : ev->signal_table[signo] != sig_entry)
+                continue;
+            sig_entry->signal_cb(signo, sigsiginfo[i].ssi_pid,
+                                 sig_entry->data);
+        }
+
+        if (n < EVE_SIGNAL_BATCH)
+            break;
+    }
+}
+
+#ifdef EV_STATS
+static inline int ev_stats_class(struct ev_entry *ev_entry)
+{
+    if (ev_entry->raw)
+        return EV_STATS_CB_RAW;
+
+    switch (ev_entry->type) {
+    case EV_TIMEOUT_ONESHOT:
+        return EV_STATS_CB_TIMER_ONESHOT;
+    case EV_TIMEOUT_PERIODIC:
+        return EV_STATS_CB_TIMER_PERIODIC;
+    case EV_SIGNAL:
+        return EV_STATS_CB_SIGNAL;
+    default:
+        return EV_STATS_CB_FD;
     }
-    if (ret != sizeof(sigsiginfo))
-        return;
-    ev_entry->signal_cb(sigsiginfo.ssi_signo, sigsiginfo.ssi_pid,
-                        ev_entry->data);
 }
+#endif
 
 static inline void ev_process_call_internal(struct ev *ev,
                                             struct ev_entry *ev_entry)
@@ -657,7 +1725,7 @@ static inline void ev_process_call_internal(struct ev *ev,
         ev_process_timer_periodic(ev_entry);
         break;
     case EV_SIGNAL:
-        ev_process_signal(ev_entry);
+        ev_process_signal(ev, ev_entry);
         break;
     default:
         return;
@@ -666,327 +1734,2532 @@ static inline void ev_process_call_internal(struct ev *ev,
     return;
 }
 
-int ev_loop(struct ev *ev, int flags)
+static struct ev_cb *ev_cb_new(void (*fn)(void *), void *arg)
 {
-    (void) flags;
-    struct epoll_event events[EVE_EPOLL_ARRAY_SIZE];
+    struct ev_cb *cb = malloc(sizeof(*cb));
+    if (!cb)
+        return NULL;
 
-    while (ev->entries > 0) {
-        int nfds = epoll_wait(ev->fd, events, EVE_EPOLL_ARRAY_SIZE, -1);
-        if (nfds < 0)
-            return -EINVAL;
+    cb->fn = fn;
+    cb->arg = arg;
+    cb->next = NULL;
+    return cb;
+}
 
-        /* multiplex and call the registerd callback handler */
-        for (int i = 0; i < nfds; i++) {
-            struct ev_entry *ev_entry = events[i].data.ptr;
-            ev_process_call_internal(ev, ev_entry);
-        }
+int ev_defer(struct ev *ev, void (*fn)(void *), void *arg)
+{
+    struct ev_cb *cb = ev_cb_new(fn, arg);
+    if (!cb)
+        return -ENOMEM;
+
+    ev_lock(ev);
+    __atomic_store_n(ev->defer_tail, cb, __ATOMIC_RELEASE);
+    ev->defer_tail = &cb->next;
+    ev_unlock(ev);
+    return 0;
+}
 
-        if (ev->break_loop)
-            break;
-    }
+int ev_check_add(struct ev *ev, void (*fn)(void *), void *arg)
+{
+    struct ev_cb *cb = ev_cb_new(fn, arg);
+    if (!cb)
+        return -ENOMEM;
+
+    ev_lock(ev);
+    cb->next = ev->checks;
+    ev->checks = cb;
+    ev_unlock(ev);
     return 0;
 }
 
-/* Unit test starts here */
+int ev_check_del(struct ev *ev, void (*fn)(void *), void *arg)
+{
+    int ret = -ENOENT;
+
+    ev_lock(ev);
+    for (struct ev_cb **pcb = &ev->checks; *pcb; pcb = &(*pcb)->next) {
+        struct ev_cb *cb = *pcb;
+        if (cb->fn != fn || cb->arg != arg)
+            continue;
+        if (ev->checks_running) {
+            cb->fn = NULL;
+        } else {
+            *pcb = cb->next;
+            free(cb);
+        }
+        ret = 0;
+        break;
+    }
+    ev_unlock(ev);
+    return ret;
+}
 
-#define SLEEP_SECONDS 1
-#define ITERATIO_MAX 2
+/* run everything deferred so far plus the check callbacks, callbacks
+ * deferred meanwhile are left for the next iteration */
+static void ev_process_end_of_batch(struct ev *ev)
+{
+    ev_lock(ev);
+    struct ev_cb *cb = ev->defer_head;
+    __atomic_store_n(&ev->defer_head, NULL, __ATOMIC_RELEASE);
+    ev->defer_tail = &ev->defer_head;
+    ev_unlock(ev);
+
+    while (cb) {
+        struct ev_cb *next = cb->next;
+        cb->fn(cb->arg);
+        free(cb);
+        cb = next;
+    }
 
-int i = 0;
+    /* serialized between workers, the lock is recursive */
+    ev_lock(ev);
+    ev->checks_running = 1;
+    for (cb = ev->checks; cb; cb = cb->next) {
+        /* callbacks may remove themselves or others */
+        if (cb->fn)
+            cb->fn(cb->arg);
+    }
+    ev->checks_running = 0;
 
-void timer_cd(void *data)
+    for (struct ev_cb **pcb = &ev->checks; *pcb;) {
+        cb = *pcb;
+        if (cb->fn) {
+            pcb = &cb->next;
+            continue;
+        }
+        *pcb = cb->next;
+        free(cb);
+    }
+    ev_unlock(ev);
+}
+
+/* spin with a zero timeout until something is ready or the budget is gone,
+ * then fall back to a blocking wait */
+static int ev_wait_busy_poll(struct ev *ev,
+                             struct epoll_event *events,
+                             int maxevents,
+                             int timeout)
 {
-    struct ev *ev = data;
-    struct ev_entry *ev_e;
-    struct timespec timespec = {SLEEP_SECONDS, 0};
+    unsigned long long deadline = ev_now_ns() + ev->busy_poll_ns;
 
-    fprintf(stderr, "timer_cd() called %d time\n", i);
-    if (i++ >= ITERATIO_MAX)
-        return;
+    do {
+        int nfds = epoll_wait(ev->fd, events, maxevents, 0);
+        if (nfds != 0)
+            return nfds;
+        ev_cpu_relax();
+    } while (ev_now_ns() < deadline);
 
-    ev_e = ev_timer_oneshot_new(&timespec, timer_cd, ev);
-    if (!ev_e) {
-        fprintf(stderr, "failed to create a ev_entry object\n");
-        exit(666);
-    }
+    return epoll_wait(ev->fd, events, maxevents, timeout);
+}
 
-    int ret = ev_add(ev, ev_e);
-    if (ret != 0)
-        fprintf(stderr, "Cannot add entry to event handler (%d)\n", i);
-    return;
+/* EV_SHARED: a sleeping worker holds back reclamation of whatever another
+ * worker retires meanwhile.  While something waits for it, wake up now and
+ * then, otherwise sleep for good and let ev_entry_retire() wake us */
+static int ev_wait_shared(struct ev *ev,
+                          struct epoll_event *events,
+                          int maxevents,
+                          int flags)
+{
+    ev_lock(ev);
+    int timeout = ev->retired ? EVE_RECLAIM_MS : -1;
+    if (timeout < 0)
+        ev->sleeping++;
+    ev_unlock(ev);
+
+    int nfds;
+    if (flags & EV_LOOP_BUSY_POLL)
+        nfds = ev_wait_busy_poll(ev, events, maxevents, timeout);
+    else
+        nfds = epoll_wait(ev->fd, events, maxevents, timeout);
+    if (timeout >= 0)
+        return nfds;
+
+    int err = errno;
+    ev_lock(ev);
+    if (--ev->sleeping == 0 && ev->poked) {
+        uint64_t val;
+        ssize_t ret = read(ev->wake_fd, &val, sizeof(val));
+        (void) ret;
+        ev->poked = 0;
+        /* that may have taken the wakeup for the end of the loop */
+        if (!__atomic_load_n(&ev->entries, __ATOMIC_SEQ_CST) ||
+            __atomic_load_n(&ev->break_loop, __ATOMIC_ACQUIRE))
+            ev_wake_all(ev);
+    }
+    ev_unlock(ev);
+    errno = err;
+    return nfds;
 }
 
-struct ev_wrapper {
-    struct ev *ev;
-    struct ev_entry *ev_entry;
-};
+static inline int ev_wait(struct ev *ev,
+                          struct epoll_event *events,
+                          int maxevents,
+                          int flags)
+{
+    int timeout = -1;
 
-static void cancel_timer_cb(void *data)
+    /* pending deferred work must not wait for the next event */
+    if (__atomic_load_n(&ev->defer_head, __ATOMIC_ACQUIRE) || ev->backlog_len)
+        return epoll_wait(ev->fd, events, maxevents, 0);
+
+    if (ev->shared)
+        return ev_wait_shared(ev, events, maxevents, flags);
+
+    if (flags & EV_LOOP_BUSY_POLL)
+        return ev_wait_busy_poll(ev, events, maxevents, timeout);
+    return epoll_wait(ev->fd, events, maxevents, timeout);
+}
+
+static inline void ev_dispatch_one(struct ev *ev, struct epoll_event *event)
 {
-    struct ev_wrapper *ev_wrapper = data;
+    struct ev_entry *ev_entry = event->data.ptr;
 
-    int ret = ev_timer_cancel(ev_wrapper->ev, ev_wrapper->ev_entry);
-    if (ret != 0) {
-        fprintf(stderr, "failed to cancel timer\n");
-        exit(EXIT_FAILURE);
-    }
+    /* removed by an earlier callback of the batch, in EV_SHARED the memory
+     * stays valid and only the flag tells */
+    if (!ev_entry)
+        return;
+    if (ev->shared && __atomic_load_n(&ev_entry->deleted, __ATOMIC_ACQUIRE))
+        return;
 
-    ev_entry_free(ev_wrapper->ev_entry);
-    return;
+    /* classify before the call, oneshot callbacks may free the entry */
+    int cb_class = ev_stats_class(ev_entry);
+    unsigned long long cb_start = ev_stats_tsc();
+    ev_entry->revents = event->events;
+    ev_process_call_internal(ev, ev_entry);
+    ev_stats_callback(ev, ev_entry, cb_class, cb_start);
+
+    if (ev->shared && ev_entry != ev->wake_entry)
+        ev_rearm(ev, ev_entry);
 }
 
-/* idea, test that timers are called in strict order and that the
- * first timer (fired after 1 seconds) cancel the 5 second timout timer */
-static int do_cancel_test(struct ev *ev)
+/* one slot per entry, events reported again while it waits are merged */
+static int ev_backlog_append(struct ev *ev, struct epoll_event *event)
 {
-    int flags = 0;
-    struct ev_entry *eve1, *eve2;
-    struct timespec timespec1 = {.tv_sec = 5, .tv_nsec = 0};
-    struct timespec timespec2 = {.tv_sec = 1, .tv_nsec = 0};
-    struct ev_wrapper *ev_wrapper;
+    struct ev_entry *ev_entry = event->data.ptr;
 
-    fprintf(stderr, "run timer cancel test ...");
+    if (ev_entry->backlog_slot) {
+        ev->backlog[ev_entry->backlog_slot - 1].events |= event->events;
+        return 0;
+    }
 
-    eve1 = ev_timer_oneshot_new((void *) &timespec1, (void *) timer_cd,
-                                (void *) ev);
-    if (!eve1) {
-        fprintf(stderr, "Failed to create a ev_entry object\n");
-        exit(EXIT_FAILURE);
+    if (ev->backlog_len == ev->backlog_cap) {
+        int cap = ev->backlog_cap ? 2 * ev->backlog_cap : EVE_EPOLL_ARRAY_SIZE;
+        struct epoll_event *tmp = realloc(ev->backlog, cap * sizeof(*tmp));
+        if (!tmp)
+            return -ENOMEM;
+        ev->backlog = tmp;
+        ev->backlog_cap = cap;
     }
+    ev->backlog[ev->backlog_len++] = *event;
+    ev_entry->backlog_slot = ev->backlog_len;
+    return 0;
+}
 
-    int ret = ev_add(ev, eve1);
+/* low priority events, held back ones first, at most low_budget of them */
+static void ev_dispatch_low(struct ev *ev,
+                            struct epoll_event *events,
+                            int nfds)
+{
+    unsigned budget = ev->low_budget;
+    int i, n = 0;
+
+    for (i = 0; i < nfds; i++) {
+        if (!events[i].data.ptr)
+            continue;
+        /* without memory dispatch right away, better than losing it */
+        if (ev_backlog_append(ev, &events[i]) < 0)
+            ev_dispatch_one(ev, &events[i]);
+    }
+
+    /* callbacks only clear slots, the array stays put meanwhile */
+    for (i = 0; i < ev->backlog_len; i++) {
+        struct ev_entry *ev_entry = ev->backlog[i].data.ptr;
+        if (budget && n == (int) budget)
+            break;
+        if (!ev_entry)
+            continue;
+        n++;
+        ev_entry->backlog_slot = 0;
+        ev_dispatch_one(ev, &ev->backlog[i]);
+    }
+
+    memmove(ev->backlog, ev->backlog + i,
+            (ev->backlog_len - i) * sizeof(*ev->backlog));
+    ev->backlog_len -= i;
+    for (int j = 0; j < ev->backlog_len; j++) {
+        struct ev_entry *ev_entry = ev->backlog[j].data.ptr;
+        if (ev_entry)
+            ev_entry->backlog_slot = j + 1;
+    }
+}
+
+/* multiplex and call the registerd callback handler, by priority.  Any
+ * callback may free entries, so the order is settled into sorted, which
+ * has room for nfds events, before the first one runs */
+static void ev_dispatch(struct ev *ev,
+                        struct epoll_event *events,
+                        struct epoll_event *sorted,
+                        int nfds)
+{
+    int count[EV_PRIO_HIGH - EV_PRIO_LOW + 1] = {0};
+    int i;
+
+    for (i = 0; i < nfds; i++) {
+        struct ev_entry *ev_entry = events[i].data.ptr;
+        count[ev_entry->priority - EV_PRIO_LOW]++;
+    }
+
+    /* stable by priority, high ones first, the common case keeps the
+     * kernel order */
+    if (count[EV_PRIO_NORMAL - EV_PRIO_LOW] != nfds) {
+        int start[EV_PRIO_HIGH - EV_PRIO_LOW + 1];
+        int pos = 0;
+        for (int prio = EV_PRIO_HIGH; prio >= EV_PRIO_LOW; prio--) {
+            start[prio - EV_PRIO_LOW] = pos;
+            pos += count[prio - EV_PRIO_LOW];
+        }
+        for (i = 0; i < nfds; i++) {
+            struct ev_entry *ev_entry = events[i].data.ptr;
+            sorted[start[ev_entry->priority - EV_PRIO_LOW]++] = events[i];
+        }
+        events = sorted;
+    }
+
+    /* the backlog is per object, shared workers dispatch low ones directly
+     * and rely on the deleted flag instead of cleared slots */
+    if (ev->shared) {
+        for (i = 0; i < nfds; i++)
+            ev_dispatch_one(ev, &events[i]);
+        return;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        struct ev_entry *ev_entry = events[i].data.ptr;
+        ev_entry->batch_slot = i + 1;
+    }
+    ev->batch = events;
+    ev->batch_len = nfds;
+
+    int low = nfds - count[EV_PRIO_LOW - EV_PRIO_LOW];
+    for (i = 0; i < low; i++)
+        ev_dispatch_one(ev, &events[i]);
+    if (low < nfds || ev->backlog_len)
+        ev_dispatch_low(ev, events + low, nfds - low);
+
+    ev->batch = NULL;
+    ev->batch_len = 0;
+}
+
+int ev_loop(struct ev *ev, int flags)
+{
+    int ret = 0;
+    int maxevents = EVE_EPOLL_ARRAY_SIZE;
+    struct epoll_event *events = malloc(maxevents * sizeof(*events));
+    struct epoll_event *sorted = malloc(maxevents * sizeof(*sorted));
+    if (!events || !sorted) {
+        free(events);
+        free(sorted);
+        return -ENOMEM;
+    }
+
+    struct ev_worker worker = {.epoch = ~0ULL};
+    if (ev->shared) {
+        ev_lock(ev);
+        worker.next = ev->workers;
+        ev->workers = &worker;
+        ev_unlock(ev);
+    }
+
+    while (__atomic_load_n(&ev->entries, __ATOMIC_ACQUIRE) > 0 ||
+           __atomic_load_n(&ev->defer_head, __ATOMIC_ACQUIRE)) {
+        /* nothing from older batches is referenced past this point */
+        if (ev->shared)
+            __atomic_store_n(&worker.epoch,
+                             __atomic_load_n(&ev->epoch, __ATOMIC_SEQ_CST),
+                             __ATOMIC_SEQ_CST);
+
+        int nfds = ev_wait(ev, events, maxevents, flags);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = -EINVAL;
+            break;
+        }
+
+        unsigned long long batch_start = ev_stats_tsc();
+        ev_stats_batch(ev, nfds);
+
+        ev_dispatch(ev, events, sorted, nfds);
+        ev_process_end_of_batch(ev);
+
+        ev_stats_dispatch(ev, batch_start);
+
+        if (ev->shared)
+            ev_reclaim(ev);
+
+        if (__atomic_load_n(&ev->break_loop, __ATOMIC_ACQUIRE))
+            break;
+
+        /* a full batch means more events are probably pending, take
+         * twice as many with the next syscall */
+        if ((flags & EV_LOOP_ADAPTIVE_BATCH) && nfds == maxevents &&
+            maxevents < EVE_EPOLL_ARRAY_MAX) {
+            struct epoll_event *tmp =
+                realloc(sorted, 2 * maxevents * sizeof(*sorted));
+            if (tmp) {
+                sorted = tmp;
+                tmp = realloc(events, 2 * maxevents * sizeof(*events));
+            }
+            if (tmp) {
+                events = tmp;
+                maxevents *= 2;
+            }
+        }
+    }
+
+    if (ev->shared) {
+        ev_lock(ev);
+        struct ev_worker **pw = &ev->workers;
+        while (*pw != &worker)
+            pw = &(*pw)->next;
+        *pw = worker.next;
+        ev_unlock(ev);
+    }
+
+    free(events);
+    free(sorted);
+    return ret;
+}
+
+/* ev_stream implementation */
+
+struct ev_stream_chunk {
+    struct ev_stream_chunk *next;
+    size_t start, end;
+    char data[EVE_STREAM_CHUNK];
+};
+
+/* write queue element, either copied data or a file segment */
+struct ev_stream_wbuf {
+    struct ev_stream_wbuf *next;
+    int in_fd;
+    int is_pipe;
+    off_t offset;
+    size_t len;
+    /* data is only used for in_fd < 0 */
+    size_t start;
+    char data[];
+};
+
+struct ev_stream {
+    struct ev *ev;
+    struct ev_entry *ev_entry;
+    int fd;
+
+    /* waits for the pipe at the head of the write queue to refill, on a
+     * dup of it, in_fd may be registered with the loop already */
+    struct ev_entry *src_entry;
+
+    void (*read_cb)(struct ev_stream *, void *);
+    void (*close_cb)(struct ev_stream *, int, void *);
+    void (*drain_cb)(struct ev_stream *, void *);
+    void *data;
+
+    /* read buffer, plus one chunk kept for the next read */
+    struct ev_stream_chunk *rhead, *rtail;
+    struct ev_stream_chunk *spare;
+    size_t rbytes;
+
+    /* write queue */
+    struct ev_stream_wbuf *whead, **wtail;
+    size_t wbytes;
+    size_t low, high;
+
+    /* currently registered epoll events */
+    uint32_t events;
+    unsigned above_high : 1;
+    unsigned flush_pending : 1;
+    unsigned in_cb : 1;
+    unsigned closed : 1;
+    unsigned freed : 1;
+};
+
+static void ev_stream_update_events(struct ev_stream *stream)
+{
+    uint32_t events = 0;
+
+    if (!stream->closed) {
+        if (!stream->above_high)
+            events |= EPOLLIN | EPOLLRDHUP;
+        /* only wait for EPOLLOUT if the last flush ran into EAGAIN on the
+         * socket, the deferred flush or the source takes care of everything
+         * else */
+        if (stream->whead && !stream->flush_pending && !stream->src_entry)
+            events |= EPOLLOUT;
+    }
+
+    if (events == stream->events)
+        return;
+    if (ev_mod_internal(stream->ev, stream->ev_entry, events) == 0)
+        stream->events = events;
+}
+
+static void ev_stream_src_stop(struct ev_stream *stream)
+{
+    if (!stream->src_entry)
+        return;
+    ev_del(stream->ev, stream->src_entry);
+    close(stream->src_entry->fd);
+    ev_entry_free(stream->src_entry);
+    stream->src_entry = NULL;
+}
+
+/* deregister, a hung up descriptor would be reported over and over */
+static void ev_stream_close(struct ev_stream *stream, int error)
+{
+    if (stream->closed)
+        return;
+    stream->closed = 1;
+    ev_stream_src_stop(stream);
+    ev_del(stream->ev, stream->ev_entry);
+    stream->close_cb(stream, error, stream->data);
+}
+
+static void ev_stream_destroy(struct ev_stream *stream)
+{
+    while (stream->rhead) {
+        struct ev_stream_chunk *next = stream->rhead->next;
+        free(stream->rhead);
+        stream->rhead = next;
+    }
+    while (stream->whead) {
+        struct ev_stream_wbuf *next = stream->whead->next;
+        free(stream->whead);
+        stream->whead = next;
+    }
+    free(stream->spare);
+    free(stream);
+}
+
+void ev_stream_free(struct ev_stream *stream)
+{
+    ev_stream_src_stop(stream);
+    if (!stream->closed)
+        ev_del(stream->ev, stream->ev_entry);
+    ev_entry_free(stream->ev_entry);
+    stream->ev_entry = NULL;
+    stream->closed = 1;
+    stream->freed = 1;
+
+    /* ev_stream_cb() or the deferred flush still references the stream,
+     * they free it */
+    if (stream->flush_pending || stream->in_cb)
+        return;
+    ev_stream_destroy(stream);
+}
+
+static void ev_stream_consume_wbuf(struct ev_stream *stream, size_t n)
+{
+    stream->wbytes -= n;
+    while (n > 0) {
+        struct ev_stream_wbuf *wbuf = stream->whead;
+        size_t len = n < wbuf->len ? n : wbuf->len;
+
+        wbuf->len -= len;
+        if (wbuf->in_fd < 0)
+            wbuf->start += len;
+        else
+            wbuf->offset += len;
+        n -= len;
+
+        if (wbuf->len > 0)
+            break;
+        stream->whead = wbuf->next;
+        if (!stream->whead)
+            stream->wtail = &stream->whead;
+        free(wbuf);
+    }
+}
+
+/* nothing to read and no writer gone, EAGAIN was not the socket's */
+static int ev_stream_pipe_empty(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/* transmit the head file segment, returns bytes written, -ENODATA for a
+ * pipe that is empty for now or -errno */
+static ssize_t ev_stream_flush_file(struct ev_stream *stream,
+                                    struct ev_stream_wbuf *wbuf)
+{
+    off_t offset = wbuf->offset;
+    ssize_t n;
+
+    /* offset is advanced by ev_stream_consume_wbuf() */
+    if (wbuf->is_pipe)
+        n = splice(wbuf->in_fd, NULL, stream->fd, NULL, wbuf->len,
+                   SPLICE_F_NONBLOCK | SPLICE_F_MOVE | SPLICE_F_MORE);
+    else
+        n = sendfile(stream->fd, wbuf->in_fd, &offset, wbuf->len);
+    if (n < 0 && errno == EAGAIN && wbuf->is_pipe &&
+        ev_stream_pipe_empty(wbuf->in_fd))
+        return -ENODATA;
+    if (n < 0)
+        return -errno;
+
+    /* premature end of the source, drop the rest of the segment */
+    if (n == 0) {
+        stream->wbytes -= wbuf->len;
+        wbuf->len = 0;
+        stream->whead = wbuf->next;
+        if (!stream->whead)
+            stream->wtail = &stream->whead;
+        free(wbuf);
+        return 0;
+    }
+    return n;
+}
+
+/* gather consecutive data buffers and writev() them, returns bytes written
+ * or -errno */
+static ssize_t ev_stream_flush_data(struct ev_stream *stream)
+{
+    struct iovec iov[EVE_STREAM_IOV_MAX];
+    int iovcnt = 0;
+
+    for (struct ev_stream_wbuf *wbuf = stream->whead;
+         wbuf && wbuf->in_fd < 0 && iovcnt < EVE_STREAM_IOV_MAX;
+         wbuf = wbuf->next) {
+        iov[iovcnt].iov_base = wbuf->data + wbuf->start;
+        iov[iovcnt].iov_len = wbuf->len;
+        iovcnt++;
+    }
+
+    ssize_t n = writev(stream->fd, iov, iovcnt);
+    if (n < 0)
+        return -errno;
+    return n;
+}
+
+static int ev_stream_src_wait(struct ev_stream *stream, int in_fd);
+
+/* returns -EPIPE if the stream was closed, it may be freed already then */
+static int ev_stream_flush(struct ev_stream *stream)
+{
+    while (stream->whead) {
+        struct ev_stream_wbuf *wbuf = stream->whead;
+        ssize_t n;
+
+        if (wbuf->in_fd < 0)
+            n = ev_stream_flush_data(stream);
+        else
+            n = ev_stream_flush_file(stream, wbuf);
+
+        if (n == -ENODATA)
+            n = ev_stream_src_wait(stream, wbuf->in_fd);
+        else
+            ev_stream_src_stop(stream);
+        if (n == -ENODATA || n == -EAGAIN || n == -EWOULDBLOCK ||
+            n == -EINTR)
+            break;
+        if (n < 0) {
+            ev_stream_close(stream, n);
+            return -EPIPE;
+        }
+        ev_stream_consume_wbuf(stream, n);
+    }
+
+    ev_stream_update_events(stream);
+    if (stream->above_high && stream->wbytes <= stream->low) {
+        stream->above_high = 0;
+        ev_stream_update_events(stream);
+        if (stream->drain_cb)
+            stream->drain_cb(stream, stream->data);
+    }
+    return 0;
+}
+
+static void ev_stream_src_cb(int fd, uint32_t events, void *data)
+{
+    struct ev_stream *stream = data;
+
+    (void) fd;
+    (void) events;
+
+    ev_stream_src_stop(stream);
+    stream->in_cb = 1;
+    ev_stream_flush(stream);
+    stream->in_cb = 0;
+    if (stream->freed && !stream->flush_pending)
+        ev_stream_destroy(stream);
+}
+
+/* the head pipe ran dry: EPOLLOUT would fire right away on a writable
+ * socket, wait for the writer instead. Returns -ENODATA or -errno */
+static int ev_stream_src_wait(struct ev_stream *stream, int in_fd)
+{
+    if (stream->src_entry)
+        return -ENODATA;
+
+    int fd = fcntl(in_fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    stream->src_entry = ev_entry_new_raw(fd, EPOLLIN, ev_stream_src_cb,
+                                         stream);
+    if (!stream->src_entry) {
+        close(fd);
+        return -ENOMEM;
+    }
+    if (ev_add(stream->ev, stream->src_entry) != 0) {
+        ev_entry_free(stream->src_entry);
+        stream->src_entry = NULL;
+        close(fd);
+        return -EINVAL;
+    }
+    return -ENODATA;
+}
+
+static void ev_stream_flush_deferred(void *arg)
+{
+    struct ev_stream *stream = arg;
+
+    stream->flush_pending = 0;
+    if (stream->freed) {
+        ev_stream_destroy(stream);
+        return;
+    }
+    if (!stream->closed)
+        ev_stream_flush(stream);
+}
+
+/* account queued data and schedule the flush for the end of the iteration */
+static int ev_stream_queued(struct ev_stream *stream, size_t len)
+{
+    stream->wbytes += len;
+
+    if (!stream->above_high && stream->wbytes > stream->high) {
+        stream->above_high = 1;
+        ev_stream_update_events(stream);
+    }
+
+    /* waiting for EPOLLOUT, the flush happens from there */
+    if (stream->flush_pending || (stream->events & EPOLLOUT))
+        return 0;
+    if (ev_defer(stream->ev, ev_stream_flush_deferred, stream) != 0)
+        return -ENOMEM;
+    stream->flush_pending = 1;
+    return 0;
+}
+
+static void ev_stream_enqueue(struct ev_stream *stream,
+                              struct ev_stream_wbuf *wbuf)
+{
+    wbuf->next = NULL;
+    *stream->wtail = wbuf;
+    stream->wtail = &wbuf->next;
+}
+
+int ev_stream_writev(struct ev_stream *stream,
+                     const struct iovec *iov,
+                     int iovcnt)
+{
+    size_t len = 0;
+
+    if (stream->closed)
+        return -EPIPE;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (len == 0)
+        return 0;
+
+    /* one allocation for the whole vector, small writes are still merged by
+     * writev() at flush time */
+    struct ev_stream_wbuf *wbuf = malloc(sizeof(*wbuf) + len);
+    if (!wbuf)
+        return -ENOMEM;
+
+    wbuf->in_fd = -1;
+    wbuf->is_pipe = 0;
+    wbuf->offset = 0;
+    wbuf->start = 0;
+    wbuf->len = len;
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(wbuf->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+
+    ev_stream_enqueue(stream, wbuf);
+    return ev_stream_queued(stream, len);
+}
+
+int ev_stream_write(struct ev_stream *stream, const void *buf, size_t len)
+{
+    struct iovec iov = {.iov_base = (void *) buf, .iov_len = len};
+    return ev_stream_writev(stream, &iov, 1);
+}
+
+int ev_stream_sendfile(struct ev_stream *stream,
+                       int in_fd,
+                       off_t offset,
+                       size_t count)
+{
+    struct stat st;
+
+    if (stream->closed)
+        return -EPIPE;
+    if (count == 0)
+        return 0;
+    if (fstat(in_fd, &st) < 0)
+        return -errno;
+
+    struct ev_stream_wbuf *wbuf = malloc(sizeof(*wbuf));
+    if (!wbuf)
+        return -ENOMEM;
+
+    wbuf->in_fd = in_fd;
+    wbuf->is_pipe = S_ISFIFO(st.st_mode);
+    wbuf->offset = offset;
+    wbuf->start = 0;
+    wbuf->len = count;
+
+    ev_stream_enqueue(stream, wbuf);
+    return ev_stream_queued(stream, count);
+}
+
+size_t ev_stream_write_pending(struct ev_stream *stream)
+{
+    return stream->wbytes;
+}
+
+int ev_stream_fd(struct ev_stream *stream)
+{
+    return stream->fd;
+}
+
+size_t ev_stream_read_avail(struct ev_stream *stream)
+{
+    return stream->rbytes;
+}
+
+const void *ev_stream_peek(struct ev_stream *stream, size_t *len)
+{
+    struct ev_stream_chunk *chunk = stream->rhead;
+
+    if (!chunk || chunk->start == chunk->end) {
+        *len = 0;
+        return NULL;
+    }
+    *len = chunk->end - chunk->start;
+    return chunk->data + chunk->start;
+}
+
+void ev_stream_consume(struct ev_stream *stream, size_t len)
+{
+    if (len > stream->rbytes)
+        len = stream->rbytes;
+    stream->rbytes -= len;
+
+    while (len > 0) {
+        struct ev_stream_chunk *chunk = stream->rhead;
+        size_t n = chunk->end - chunk->start;
+
+        if (n > len)
+            n = len;
+        chunk->start += n;
+        len -= n;
+        if (chunk->start < chunk->end)
+            break;
+
+        /* keep the last chunk for the next read */
+        if (!chunk->next) {
+            chunk->start = chunk->end = 0;
+            break;
+        }
+        stream->rhead = chunk->next;
+        if (stream->spare) {
+            free(chunk);
+        } else {
+            chunk->next = NULL;
+            chunk->start = chunk->end = 0;
+            stream->spare = chunk;
+        }
+    }
+}
+
+size_t ev_stream_read(struct ev_stream *stream, void *buf, size_t len)
+{
+    size_t copied = 0;
+
+    while (copied < len) {
+        size_t n;
+        const void *p = ev_stream_peek(stream, &n);
+        if (!p)
+            break;
+        if (n > len - copied)
+            n = len - copied;
+        memcpy((char *) buf + copied, p, n);
+        ev_stream_consume(stream, n);
+        copied += n;
+    }
+    return copied;
+}
+
+static struct ev_stream_chunk *ev_stream_chunk_new(void)
+{
+    struct ev_stream_chunk *chunk = malloc(sizeof(*chunk));
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->start = chunk->end = 0;
+    return chunk;
+}
+
+/* read into the free space of the tail chunk plus the spare chunk, returns
+ * bytes read, 0 on EOF or -errno */
+static ssize_t ev_stream_fill(struct ev_stream *stream)
+{
+    struct ev_stream_chunk *tail = stream->rtail;
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (!stream->spare && !(stream->spare = ev_stream_chunk_new()))
+        return -ENOMEM;
+
+    struct ev_stream_chunk *spare = stream->spare;
+
+    if (tail->end < EVE_STREAM_CHUNK) {
+        iov[iovcnt].iov_base = tail->data + tail->end;
+        iov[iovcnt].iov_len = EVE_STREAM_CHUNK - tail->end;
+        iovcnt++;
+    }
+    iov[iovcnt].iov_base = spare->data;
+    iov[iovcnt].iov_len = EVE_STREAM_CHUNK;
+    iovcnt++;
+
+    ssize_t n = readv(stream->fd, iov, iovcnt);
+    if (n <= 0)
+        return n < 0 ? -errno : 0;
+    stream->rbytes += n;
+
+    size_t room = iovcnt == 2 ? EVE_STREAM_CHUNK - tail->end : 0;
+    if ((size_t) n <= room) {
+        tail->end += n;
+        return n;
+    }
+
+    tail->end += room;
+    spare->end = n - room;
+    tail->next = spare;
+    stream->rtail = spare;
+    stream->spare = NULL;
+    return n;
+}
+
+static void ev_stream_cb(int fd, uint32_t events, void *data)
+{
+    struct ev_stream *stream = data;
+    uint32_t revents = stream->ev_entry->revents;
+
+    (void) fd;
+    (void) events;
+
+    /* any of the callbacks may free the stream, that is deferred to the
+     * end of this function */
+    stream->in_cb = 1;
+
+    if (revents & EPOLLOUT)
+        ev_stream_flush(stream);
+
+    if (!stream->closed &&
+        (revents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        ssize_t n = ev_stream_fill(stream);
+        if (n > 0)
+            stream->read_cb(stream, stream->data);
+        else if (n != -EAGAIN && n != -EWOULDBLOCK && n != -EINTR)
+            ev_stream_close(stream, n);
+    }
+
+    stream->in_cb = 0;
+    if (stream->freed && !stream->flush_pending)
+        ev_stream_destroy(stream);
+}
+
+struct ev_stream *ev_stream_new(struct ev *ev,
+                                int fd,
+                                void (*read_cb)(struct ev_stream *, void *),
+                                void (*close_cb)(struct ev_stream *,
+                                                 int,
+                                                 void *),
+                                void *data)
+{
+    struct ev_stream *stream = malloc(sizeof(*stream));
+    if (!stream)
+        return NULL;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->ev = ev;
+    stream->fd = fd;
+    stream->read_cb = read_cb;
+    stream->close_cb = close_cb;
+    stream->data = data;
+    stream->wtail = &stream->whead;
+    stream->low = EVE_STREAM_LOW_WATERMARK;
+    stream->high = EVE_STREAM_HIGH_WATERMARK;
+    stream->events = EPOLLIN | EPOLLRDHUP;
+
+    stream->rhead = stream->rtail = ev_stream_chunk_new();
+    if (!stream->rhead)
+        goto err;
+
+    stream->ev_entry = ev_entry_new_raw(fd, stream->events, ev_stream_cb,
+                                        stream);
+    if (!stream->ev_entry)
+        goto err;
+
+    if (ev_add(ev, stream->ev_entry) != 0) {
+        ev_entry_free(stream->ev_entry);
+        goto err;
+    }
+    return stream;
+
+err:
+    free(stream->rhead);
+    free(stream);
+    return NULL;
+}
+
+void ev_stream_watermark_set(struct ev_stream *stream,
+                             size_t low,
+                             size_t high,
+                             void (*drain_cb)(struct ev_stream *, void *))
+{
+    stream->low = low;
+    stream->high = high;
+    stream->drain_cb = drain_cb;
+}
+
+/* Unit test starts here */
+
+#define SLEEP_SECONDS 1
+#define ITERATIO_MAX 2
+
+int i = 0;
+
+void timer_cd(void *data)
+{
+    struct ev *ev = data;
+    struct ev_entry *ev_e;
+    struct timespec timespec = {SLEEP_SECONDS, 0};
+
+    fprintf(stderr, "timer_cd() called %d time\n", i);
+    if (i++ >= ITERATIO_MAX)
+        return;
+
+    ev_e = ev_timer_oneshot_new(&timespec, NULL, timer_cd, ev);
+    if (!ev_e) {
+        fprintf(stderr, "failed to create a ev_entry object\n");
+        exit(666);
+    }
+
+    int ret = ev_add(ev, ev_e);
+    if (ret != 0)
+        fprintf(stderr, "Cannot add entry to event handler (%d)\n", i);
+    return;
+}
+
+struct ev_wrapper {
+    struct ev *ev;
+    struct ev_entry *ev_entry;
+};
+
+static void cancel_timer_cb(void *data)
+{
+    struct ev_wrapper *ev_wrapper = data;
+
+    int ret = ev_timer_cancel(ev_wrapper->ev, ev_wrapper->ev_entry);
+    if (ret != 0) {
+        fprintf(stderr, "failed to cancel timer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_entry_free(ev_wrapper->ev_entry);
+    return;
+}
+
+/* idea, test that timers are called in strict order and that the
+ * first timer (fired after 1 seconds) cancel the 5 second timout timer */
+static int do_cancel_test(struct ev *ev)
+{
+    int flags = 0;
+    struct ev_entry *eve1, *eve2;
+    struct timespec timespec1 = {.tv_sec = 5, .tv_nsec = 0};
+    struct timespec timespec2 = {.tv_sec = 1, .tv_nsec = 0};
+    struct ev_wrapper *ev_wrapper;
+
+    fprintf(stderr, "run timer cancel test ...");
+
+    eve1 = ev_timer_oneshot_new((void *) &timespec1, NULL, (void *) timer_cd,
+                                (void *) ev);
+    if (!eve1) {
+        fprintf(stderr, "Failed to create a ev_entry object\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int ret = ev_add(ev, eve1);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot add entry to event handler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_wrapper = malloc(sizeof(struct ev_wrapper));
+    if (!ev_wrapper) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_wrapper->ev = ev;
+    ev_wrapper->ev_entry = eve1;
+
+    eve2 = ev_timer_oneshot_new((void *) &timespec2, NULL,
+                                (void *) cancel_timer_cb, (void *) ev_wrapper);
+    if (!eve2) {
+        fprintf(stderr, "Failed to create a ev_entry object\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = ev_add(ev, eve2);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot add entry to event handler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_loop(ev, flags);
+
+    free(ev_wrapper);
+
+    fprintf(stderr, " passed\n");
+    return 1;
+}
+
+static void test_timer(void)
+{
+    struct ev *ev = ev_new(0);
+    if (!ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    do_cancel_test(ev);
+    ev_destroy(ev);
+}
+
+struct ctx_timer {
+    struct ev_entry *eve;
+    struct ev *ev;
+    unsigned periodic_runs;
+};
+
+struct ctx_timer *ctx_timer_new(void)
+{
+    struct ctx_timer *ctxo = malloc(sizeof(*ctxo));
+    if (!ctxo)
+        abort();
+    memset(ctxo, 0, sizeof(*ctxo));
+    return ctxo;
+}
+
+void callback_oneshot(void *data)
+{
+    struct ctx_timer *ctxo = data;
+
+    ev_entry_free(ctxo->eve);
+    free(ctxo);
+
+    fprintf(stderr, "callback called\n");
+}
+
+static void test_timer_oneshot(void)
+{
+    int flags = 0, ret;
+    struct ev_entry *eve;
+    struct ctx_timer *ctxo;
+    struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+
+    fprintf(stderr, "Test: oneshot timer\n");
+
+    struct ev *ev = ev_new(0);
+    if (!ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    ctxo = ctx_timer_new();
+    ctxo->ev = ev;
+
+    eve = ev_timer_oneshot_new(&ts, NULL, callback_oneshot, ctxo);
+    if (!eve) {
+        fprintf(stderr, "Failed to create a ev_entry object\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ctxo->eve = eve;
+
+    ret = ev_add(ev, eve);
     if (ret != 0) {
         fprintf(stderr, "Cannot add entry to event handler\n");
         exit(EXIT_FAILURE);
     }
 
-    ev_wrapper = malloc(sizeof(struct ev_wrapper));
-    if (!ev_wrapper) {
-        perror("malloc");
+    // ev_loop will run until the timeout is fired. Which
+    // in turn is the last event, which will end the ev loop
+    ev_loop(ev, flags);
+
+    ev_destroy(ev);
+}
+
+void callback_timer_periodic(unsigned long long missed, void *data)
+{
+    struct ctx_timer *ctxo = data;
+
+    fprintf(stderr, "callback timer periodic called %d\n", ctxo->periodic_runs);
+
+    if (missed > 1)
+        fprintf(stderr, "missed timer events: %llu\n", missed - 1);
+
+    ctxo->periodic_runs--;
+    if (ctxo->periodic_runs == 0) {
+        // finish, enough testing
+        int ret = ev_timer_cancel(ctxo->ev, ctxo->eve);
+        if (ret < 0) {
+            fprintf(stderr, "failed to cancel timer\n");
+            exit(EXIT_FAILURE);
+        }
+        ev_entry_free(ctxo->eve);
+        free(ctxo);
+    }
+}
+
+static void test_timer_periodic(void)
+{
+    int flags = 0;
+    struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+
+    fprintf(stderr, "Test: periodic timer\n");
+
+    struct ev *ev = ev_new(0);
+    if (!ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    struct ctx_timer *ctxo = ctx_timer_new();
+    ctxo->ev = ev;
+    ctxo->periodic_runs = 5;
+
+    struct ev_entry *eve =
+        ev_timer_periodic_new(&ts, NULL, callback_timer_periodic, ctxo);
+    if (!eve) {
+        fprintf(stderr, "Failed to create a ev_entry object\n");
+        exit(EXIT_FAILURE);
+    }
+    ctxo->eve = eve;
+
+    int ret = ev_add(ev, eve);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot add entry to event handler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // ev_loop will run until the timeout is fired. Which
+    // in turn is the last event, which will end the ev loop
+    ev_loop(ev, flags);
+
+    ev_destroy(ev);
+}
+
+static uint32_t events = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP;
+
+void fd_cb_raw(int fd, uint32_t events_ret, void *priv_data)
+{
+    struct ev *ev = priv_data;
+
+    (void) fd;
+
+    assert(events == events_ret);
+    ev_run_out(ev);
+}
+
+void test_events_raw(void)
+{
+    struct ev *ev;
+    int flags = 0, ret;
+    struct ev_entry *eve;
+    int pipefd[2];
+
+    fprintf(stderr, "Test: raw events\n");
+
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    ev = ev_new(0);
+    if (!ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    eve = ev_entry_new_raw(pipefd[0], events, fd_cb_raw, ev);
+    if (!eve) {
+        fprintf(stderr, "Failed to create a ev_entry object\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = ev_add(ev, eve);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot add entry to event handler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    write(pipefd[1], "1", 1);
+
+    // ev_loop will run until the timeout is fired. Which
+    // in turn is the last event, which will end the ev loop
+    ev_loop(ev, flags);
+
+    ev_entry_free(eve);
+    ev_destroy(ev);
+}
+
+#define BATCH_PIPES 200
+
+struct ctx_batch {
+    struct ev *ev;
+    struct ev_entry *eve[BATCH_PIPES];
+    int pipefd[BATCH_PIPES][2];
+    unsigned calls;
+};
+
+void fd_cb_batch(int fd, uint32_t events_ret, void *priv_data)
+{
+    struct ctx_batch *ctx = priv_data;
+
+    (void) events_ret;
+
+    for (int i = 0; i < BATCH_PIPES; i++) {
+        if (ctx->pipefd[i][0] != fd)
+            continue;
+        ev_del(ctx->ev, ctx->eve[i]);
+        break;
+    }
+    ctx->calls++;
+}
+
+/* more ready descriptors than EVE_EPOLL_ARRAY_SIZE, every one must be
+ * dispatched exactly once with busy polling and a growing batch */
+void test_events_busy_poll_batch(void)
+{
+    struct ctx_batch ctx;
+
+    fprintf(stderr, "Test: busy poll and adaptive batch\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+    ev_busy_poll_set(ctx.ev, 10);
+
+    for (int i = 0; i < BATCH_PIPES; i++) {
+        if (pipe(ctx.pipefd[i]) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        ctx.eve[i] = ev_entry_new_raw(ctx.pipefd[i][0], EPOLLIN, fd_cb_batch,
+                                      &ctx);
+        if (!ctx.eve[i]) {
+            fprintf(stderr, "Failed to create a ev_entry object\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ev_add(ctx.ev, ctx.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+        write(ctx.pipefd[i][1], "1", 1);
+    }
+
+    ev_loop(ctx.ev, EV_LOOP_BUSY_POLL | EV_LOOP_ADAPTIVE_BATCH);
+    assert(ctx.calls == BATCH_PIPES);
+
+    struct ev_stats stats;
+    if (ev_stats(ctx.ev, &stats) == 0) {
+        assert(stats.events == BATCH_PIPES);
+        /* bucket b holds batches of [2^b, 2^(b+1)) events, one above
+         * EVE_EPOLL_ARRAY_SIZE is only reachable by a grown array */
+        unsigned long long grown = 0;
+        for (int b = 0; b < EV_STATS_BUCKETS; b++)
+            if ((1ULL << b) > EVE_EPOLL_ARRAY_SIZE)
+                grown += stats.batch[b];
+        assert(grown > 0);
+        fprintf(stderr, "%llu events in %llu iterations\n", stats.events,
+                stats.iterations);
+    }
+
+    for (int i = 0; i < BATCH_PIPES; i++) {
+        ev_entry_free(ctx.eve[i]);
+        close(ctx.pipefd[i][0]);
+        close(ctx.pipefd[i][1]);
+    }
+    ev_destroy(ctx.ev);
+}
+
+struct ctx_coalesce {
+    struct ev *ev;
+    struct ev_entry *eve[3];
+    int pipefd[3][2];
+    int flush_pending;
+    unsigned events, flushes, checks, victims;
+};
+
+static void coalesce_flush(void *arg)
+{
+    struct ctx_coalesce *ctx = arg;
+
+    ctx->flush_pending = 0;
+    ctx->flushes++;
+}
+
+/* removed by coalesce_check before it gets to run */
+static void coalesce_victim(void *arg)
+{
+    struct ctx_coalesce *ctx = arg;
+
+    ctx->victims++;
+}
+
+static void coalesce_check(void *arg)
+{
+    struct ctx_coalesce *ctx = arg;
+
+    ctx->checks++;
+    ev_check_del(ctx->ev, coalesce_victim, ctx);
+    for (int i = 0; i < 3; i++)
+        ev_del(ctx->ev, ctx->eve[i]);
+}
+
+void fd_cb_coalesce(int fd, uint32_t events_ret, void *priv_data)
+{
+    struct ctx_coalesce *ctx = priv_data;
+
+    (void) fd;
+    (void) events_ret;
+
+    ctx->events++;
+    if (ctx->flush_pending)
+        return;
+    ctx->flush_pending = 1;
+    if (ev_defer(ctx->ev, coalesce_flush, ctx) != 0) {
+        fprintf(stderr, "Cannot defer callback\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* three ready descriptors in one batch share one deferred flush, the
+ * check callback runs once after it and removes the one behind it */
+void test_defer_coalesce(void)
+{
+    struct ctx_coalesce ctx;
+
+    fprintf(stderr, "Test: deferred and check callbacks\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (pipe(ctx.pipefd[i]) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        ctx.eve[i] = ev_entry_new_raw(ctx.pipefd[i][0], EPOLLIN,
+                                      fd_cb_coalesce, &ctx);
+        if (!ctx.eve[i] || ev_add(ctx.ev, ctx.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+        write(ctx.pipefd[i][1], "1", 1);
+    }
+
+    /* checks run newest first */
+    if (ev_check_add(ctx.ev, coalesce_victim, &ctx) != 0 ||
+        ev_check_add(ctx.ev, coalesce_check, &ctx) != 0) {
+        fprintf(stderr, "Cannot add check callback\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_loop(ctx.ev, 0);
+    assert(ctx.events == 3);
+    assert(ctx.flushes == 1);
+    assert(ctx.checks == 1);
+    assert(ctx.victims == 0);
+    if (ev_check_del(ctx.ev, coalesce_victim, &ctx) != -ENOENT ||
+        ev_check_del(ctx.ev, coalesce_check, &ctx) != 0 ||
+        ev_check_del(ctx.ev, coalesce_check, &ctx) != -ENOENT) {
+        fprintf(stderr, "Wrong check callback removal\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        ev_entry_free(ctx.eve[i]);
+        close(ctx.pipefd[i][0]);
+        close(ctx.pipefd[i][1]);
+    }
+    ev_destroy(ctx.ev);
+}
+
+#define SLACK_TIMERS 10
+
+struct ctx_slack {
+    struct ev *ev;
+    struct ev_entry *eve[SLACK_TIMERS];
+    unsigned fired, fired_batch, passes;
+};
+
+static void slack_timer_cb(void *data)
+{
+    struct ctx_slack *ctx = data;
+
+    ctx->fired++;
+    ctx->fired_batch++;
+}
+
+static void slack_check(void *data)
+{
+    struct ctx_slack *ctx = data;
+
+    if (!ctx->fired_batch)
+        return;
+    ctx->fired_batch = 0;
+    ctx->passes++;
+}
+
+/* timers spread over 10ms with a 200ms default slack end up in at most two
+ * slack windows, i.e. they cannot cause more than two expiry passes */
+void test_timer_slack(void)
+{
+    struct ctx_slack ctx;
+    struct timespec slack = {.tv_sec = 0, .tv_nsec = 200000000};
+
+    fprintf(stderr, "Test: timer slack\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+    ev_timer_slack_set(ctx.ev, &slack);
+
+    for (int i = 0; i < SLACK_TIMERS; i++) {
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000 * (i + 1)};
+        ctx.eve[i] = ev_timer_oneshot_new(&ts, NULL, slack_timer_cb, &ctx);
+        if (!ctx.eve[i] || ev_add(ctx.ev, ctx.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ev_check_add(ctx.ev, slack_check, &ctx) != 0) {
+        fprintf(stderr, "Cannot add check callback\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_loop(ctx.ev, 0);
+    assert(ctx.fired == SLACK_TIMERS);
+    assert(ctx.passes <= 2);
+
+    for (int i = 0; i < SLACK_TIMERS; i++)
+        ev_entry_free(ctx.eve[i]);
+    ev_destroy(ctx.ev);
+}
+
+#define STREAM_FILE_SIZE 100000
+
+struct ctx_stream {
+    struct ev_stream *tx, *rx;
+    char header[16];
+    size_t received;
+    unsigned drained;
+    int errors;
+};
+
+static void stream_tx_read_cb(struct ev_stream *stream, void *data)
+{
+    (void) data;
+    ev_stream_consume(stream, ev_stream_read_avail(stream));
+}
+
+static void stream_close_cb(struct ev_stream *stream, int error, void *data)
+{
+    struct ctx_stream *ctx = data;
+
+    (void) stream;
+    (void) error;
+    ctx->errors++;
+}
+
+static void stream_drain_cb(struct ev_stream *stream, void *data)
+{
+    struct ctx_stream *ctx = data;
+
+    (void) stream;
+    ctx->drained++;
+}
+
+static void stream_rx_read_cb(struct ev_stream *stream, void *data)
+{
+    struct ctx_stream *ctx = data;
+    size_t len;
+    const unsigned char *p;
+
+    while ((p = ev_stream_peek(stream, &len))) {
+        for (size_t i = 0; i < len; i++, ctx->received++) {
+            if (ctx->received < sizeof(ctx->header))
+                assert(p[i] == (unsigned char) ctx->header[ctx->received]);
+            else
+                assert(p[i] == ((ctx->received - sizeof(ctx->header)) & 0xff));
+        }
+        ev_stream_consume(stream, len);
+    }
+
+    if (ctx->received == sizeof(ctx->header) + STREAM_FILE_SIZE) {
+        ev_stream_free(ctx->tx);
+        ev_stream_free(ctx->rx);
+    }
+}
+
+/* scatter-gather header plus a sendfile() body over a socketpair, the body
+ * exceeds the high watermark and must end with a drain notification */
+void test_stream(void)
+{
+    struct ctx_stream ctx;
+    int sv[2];
+
+    fprintf(stderr, "Test: buffered stream\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    memcpy(ctx.header, "ev_stream header", sizeof(ctx.header));
+
+    FILE *file = tmpfile();
+    if (!file) {
+        perror("tmpfile");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < STREAM_FILE_SIZE; i++)
+        fputc(i & 0xff, file);
+    fflush(file);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    struct ev *ev = ev_new(0);
+    if (!ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    ctx.tx = ev_stream_new(ev, sv[0], stream_tx_read_cb, stream_close_cb, &ctx);
+    ctx.rx = ev_stream_new(ev, sv[1], stream_rx_read_cb, stream_close_cb, &ctx);
+    if (!ctx.tx || !ctx.rx) {
+        fprintf(stderr, "Cannot create stream\n");
+        exit(EXIT_FAILURE);
+    }
+    ev_stream_watermark_set(ctx.tx, 1024, 4096, stream_drain_cb);
+
+    struct iovec iov[2] = {
+        {.iov_base = ctx.header, .iov_len = 8},
+        {.iov_base = ctx.header + 8, .iov_len = sizeof(ctx.header) - 8},
+    };
+    if (ev_stream_writev(ctx.tx, iov, 2) != 0 ||
+        ev_stream_sendfile(ctx.tx, fileno(file), 0, STREAM_FILE_SIZE) != 0) {
+        fprintf(stderr, "Cannot queue stream data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_loop(ev, 0);
+    assert(ctx.received == sizeof(ctx.header) + STREAM_FILE_SIZE);
+    assert(ctx.drained >= 1);
+    assert(ctx.errors == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+    fclose(file);
+    ev_destroy(ev);
+}
+
+struct ctx_stream_free {
+    struct ev *ev;
+    struct ev_stream *tx;
+    struct ev_entry *timer, *pusher;
+    int sv[2], pipefd[2];
+    unsigned drained, closed;
+};
+
+static void stream_free_drain_cb(struct ev_stream *stream, void *data)
+{
+    struct ctx_stream_free *ctx = data;
+
+    ctx->drained++;
+    ev_stream_free(stream);
+    ev_del(ctx->ev, ctx->pusher);
+}
+
+static void stream_free_close_cb(struct ev_stream *stream,
+                                 int error,
+                                 void *data)
+{
+    struct ctx_stream_free *ctx = data;
+
+    (void) stream;
+    (void) error;
+    ctx->closed++;
+}
+
+/* make the stream writable and readable at once, and wake the pusher */
+static void stream_free_timer_cb(void *data)
+{
+    struct ctx_stream_free *ctx = data;
+    char buf[65536];
+
+    while (read(ctx->sv[1], buf, sizeof(buf)) > 0)
+        ;
+    write(ctx->sv[1], "x", 1);
+    write(ctx->pipefd[1], "1", 1);
+}
+
+/* runs first in the batch and pushes the stream above its high watermark
+ * after EPOLLIN was reported for it */
+void fd_cb_stream_pusher(int fd, uint32_t events_ret, void *priv_data)
+{
+    struct ctx_stream_free *ctx = priv_data;
+    char buf[8192];
+
+    (void) events_ret;
+
+    read(fd, buf, 1);
+    memset(buf, 0, sizeof(buf));
+    if (ev_stream_write(ctx->tx, buf, sizeof(buf)) != 0) {
+        fprintf(stderr, "Cannot queue stream data\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* the drain notification on EPOLLOUT frees the stream while EPOLLIN is
+ * pending in the same event */
+void test_stream_free_in_drain(void)
+{
+    struct ctx_stream_free ctx;
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = 20000000};
+    char buf[4096];
+
+    fprintf(stderr, "Test: stream freed from drain callback\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, ctx.sv) < 0 ||
+        pipe(ctx.pipefd) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    /* fill the socket so the first flush runs into EAGAIN */
+    memset(buf, 0, sizeof(buf));
+    while (write(ctx.sv[0], buf, sizeof(buf)) > 0)
+        ;
+
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    ctx.tx = ev_stream_new(ctx.ev, ctx.sv[0], stream_tx_read_cb,
+                           stream_free_close_cb, &ctx);
+    ctx.pusher = ev_entry_new_raw(ctx.pipefd[0], EPOLLIN, fd_cb_stream_pusher,
+                                  &ctx);
+    ctx.timer = ev_timer_oneshot_new(&timeout, NULL, stream_free_timer_cb,
+                                     &ctx);
+    if (!ctx.tx || !ctx.pusher || !ctx.timer) {
+        fprintf(stderr, "Cannot create stream\n");
+        exit(EXIT_FAILURE);
+    }
+    ev_entry_priority_set(ctx.pusher, EV_PRIO_HIGH);
+    if (ev_add(ctx.ev, ctx.pusher) != 0 || ev_add(ctx.ev, ctx.timer) != 0) {
+        fprintf(stderr, "Cannot add entry to event handler\n");
+        exit(EXIT_FAILURE);
+    }
+    ev_stream_watermark_set(ctx.tx, 1024, 4096, stream_free_drain_cb);
+
+    if (ev_stream_write(ctx.tx, buf, 100) != 0) {
+        fprintf(stderr, "Cannot queue stream data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ev_loop(ctx.ev, 0);
+    assert(ctx.drained == 1);
+    assert(ctx.closed == 0);
+
+    ev_entry_free(ctx.pusher);
+    ev_entry_free(ctx.timer);
+    for (int i = 0; i < 2; i++) {
+        close(ctx.sv[i]);
+        close(ctx.pipefd[i]);
+    }
+    ev_destroy(ctx.ev);
+}
+
+struct ctx_stream_pipe {
+    struct ev_stream *tx, *rx;
+    int pipefd[2];
+    double idle_cpu;
+    size_t received;
+    unsigned errors;
+};
+
+static double stream_pipe_cpu(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the pipe stayed empty until now, then its writer shows up */
+static void stream_pipe_timer_cb(void *data)
+{
+    struct ctx_stream_pipe *ctx = data;
+
+    ctx->idle_cpu = stream_pipe_cpu() - ctx->idle_cpu;
+    write(ctx->pipefd[1], "pipe", 4);
+}
+
+static void stream_pipe_rx_cb(struct ev_stream *stream, void *data)
+{
+    struct ctx_stream_pipe *ctx = data;
+    char buf[16];
+
+    ctx->received += ev_stream_read(stream, buf, sizeof(buf));
+    if (ctx->received == 4) {
+        ev_stream_free(ctx->tx);
+        ev_stream_free(ctx->rx);
+    }
+}
+
+static void stream_pipe_close_cb(struct ev_stream *stream,
+                                 int error,
+                                 void *data)
+{
+    struct ctx_stream_pipe *ctx = data;
+
+    (void) stream;
+    (void) error;
+    ctx->errors++;
+}
+
+/* an empty pipe queued on a writable socket must not spin the loop */
+void test_stream_pipe_idle(void)
+{
+    struct ctx_stream_pipe ctx;
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = 100000000};
+    int sv[2];
+
+    fprintf(stderr, "Test: stream waiting for an empty pipe\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) < 0 ||
+        pipe(ctx.pipefd) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    struct ev *ev = ev_new(0);
+    if (!ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
+
+    ctx.tx = ev_stream_new(ev, sv[0], stream_tx_read_cb,
+                           stream_pipe_close_cb, &ctx);
+    ctx.rx = ev_stream_new(ev, sv[1], stream_pipe_rx_cb,
+                           stream_pipe_close_cb, &ctx);
+    struct ev_entry *timer =
+        ev_timer_oneshot_new(&timeout, NULL, stream_pipe_timer_cb, &ctx);
+    if (!ctx.tx || !ctx.rx || !timer || ev_add(ev, timer) != 0) {
+        fprintf(stderr, "Cannot create stream\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ev_stream_sendfile(ctx.tx, ctx.pipefd[0], 0, 4) != 0) {
+        fprintf(stderr, "Cannot queue stream data\n");
         exit(EXIT_FAILURE);
     }
 
-    ev_wrapper->ev = ev;
-    ev_wrapper->ev_entry = eve1;
+    ctx.idle_cpu = stream_pipe_cpu();
+    ev_loop(ev, 0);
+    assert(ctx.received == 4);
+    assert(ctx.errors == 0);
+    /* spinning on EPOLLOUT burns the whole 100 ms */
+    assert(ctx.idle_cpu < 0.05);
+
+    ev_entry_free(timer);
+    for (int i = 0; i < 2; i++) {
+        close(sv[i]);
+        close(ctx.pipefd[i]);
+    }
+    ev_destroy(ev);
+}
+
+struct ctx_signal {
+    struct ev *ev;
+    struct ev_entry *eve[2];
+    unsigned usr1, usr2;
+};
+
+static void signal_cb(uint32_t signo, uint32_t pid, void *data)
+{
+    struct ctx_signal *ctx = data;
+
+    assert(pid == (uint32_t) getpid());
+    if (signo == SIGUSR1)
+        ctx->usr1++;
+    if (signo == SIGUSR2)
+        ctx->usr2++;
+
+    if (ctx->usr1 && ctx->usr2) {
+        ev_del(ctx->ev, ctx->eve[0]);
+        ev_del(ctx->ev, ctx->eve[1]);
+    }
+}
+
+/* two signal entries share one signalfd and are dispatched by number */
+void test_signal(void)
+{
+    struct ctx_signal ctx;
 
-    eve2 = ev_timer_oneshot_new((void *) &timespec2, (void *) cancel_timer_cb,
-                                (void *) ev_wrapper);
-    if (!eve2) {
-        fprintf(stderr, "Failed to create a ev_entry object\n");
-        exit(EXIT_FAILURE);
+    fprintf(stderr, "Test: signals\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
     }
 
-    ret = ev_add(ev, eve2);
-    if (ret != 0) {
+    ctx.eve[0] = ev_signal_new(SIGUSR1, signal_cb, &ctx);
+    ctx.eve[1] = ev_signal_new(SIGUSR2, signal_cb, &ctx);
+    if (!ctx.eve[0] || !ctx.eve[1] || ev_add(ctx.ev, ctx.eve[0]) != 0 ||
+        ev_add(ctx.ev, ctx.eve[1]) != 0) {
         fprintf(stderr, "Cannot add entry to event handler\n");
         exit(EXIT_FAILURE);
     }
 
-    ev_loop(ev, flags);
+    kill(getpid(), SIGUSR1);
+    kill(getpid(), SIGUSR2);
 
-    free(ev_wrapper);
+    ev_loop(ctx.ev, 0);
+    assert(ctx.usr1 == 1 && ctx.usr2 == 1);
 
-    fprintf(stderr, " passed\n");
-    return 1;
+    ev_entry_free(ctx.eve[0]);
+    ev_entry_free(ctx.eve[1]);
+    ev_destroy(ctx.ev);
 }
 
-static void test_timer(void)
+/* Benchmark starts here */
+
+#include <sys/resource.h>
+
+#define OPTION_BENCHMARK "benchmark"
+#define BENCH_TIMERS 100000
+#define BENCH_MESSAGES 200000
+#define BENCH_FANIN_IDLE 8000
+#define BENCH_FANIN_HOT 4
+#define BENCH_CHAIN_MAX 256
+/* kept free for stdio, epoll and eventfds */
+#define BENCH_FD_SPARE 64
+
+/* raise the fd limit as far as allowed, every timer and socket needs one */
+static unsigned long bench_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return 1024;
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return rl.rlim_cur;
+}
+
+static void bench_timer_cb(void *data)
 {
+    (void) data;
+}
+
+/* arm and cancel far away oneshot timers, i.e. the pure bookkeeping cost */
+static void bench_timers(unsigned long count)
+{
+    struct timespec ts = {.tv_sec = 3600, .tv_nsec = 0};
+    struct ev_entry **eve = malloc(count * sizeof(*eve));
     struct ev *ev = ev_new(0);
-    if (!ev) {
+    if (!eve || !ev) {
         fprintf(stderr, "Cannot create event handler\n");
-        return;
+        exit(EXIT_FAILURE);
     }
 
-    do_cancel_test(ev);
+    unsigned long long start = ev_now_ns();
+    for (unsigned long i = 0; i < count; i++) {
+        eve[i] = ev_timer_oneshot_new(&ts, NULL, bench_timer_cb, NULL);
+        if (!eve[i] || ev_add(ev, eve[i]) != 0) {
+            fprintf(stderr, "Cannot add timer %lu\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long long armed = ev_now_ns();
+    for (unsigned long i = 0; i < count; i++) {
+        ev_timer_cancel(ev, eve[i]);
+        ev_entry_free(eve[i]);
+    }
+    unsigned long long cancelled = ev_now_ns();
+
+    printf("timers: %lu arm %llu ns/op cancel %llu ns/op\n", count,
+           (armed - start) / count, (cancelled - armed) / count);
+
     ev_destroy(ev);
+    free(eve);
 }
 
-struct ctx_timer {
-    struct ev_entry *eve;
+struct bench_pp {
     struct ev *ev;
-    unsigned periodic_runs;
+    unsigned long sent, limit;
+    unsigned long long *lat;
+    unsigned long nlat;
 };
 
-struct ctx_timer *ctx_timer_new(void)
+static int bench_cmp(const void *a, const void *b)
 {
-    struct ctx_timer *ctxo = malloc(sizeof(*ctxo));
-    if (!ctxo)
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return (x > y) - (x < y);
+}
+
+/* every message carries its send time, bounce it back to the peer until
+ * the message budget is used up */
+static void bench_pp_cb(int fd, uint32_t events, void *data)
+{
+    struct bench_pp *pp = data;
+    unsigned long long stamp;
+
+    (void) events;
+
+    if (read(fd, &stamp, sizeof(stamp)) != sizeof(stamp))
+        return;
+
+    unsigned long long now = ev_now_ns();
+    pp->lat[pp->nlat++] = now - stamp;
+
+    if (pp->sent >= pp->limit) {
+        ev_run_out(pp->ev);
+        return;
+    }
+    pp->sent++;
+    if (write(fd, &now, sizeof(now)) != sizeof(now))
         abort();
-    memset(ctxo, 0, sizeof(*ctxo));
-    return ctxo;
 }
 
-void callback_oneshot(void *data)
+/* chains socketpairs bounce a message each, idle socketpairs are only
+ * registered to show the cost of a large, mostly quiet epoll set */
+static void bench_pingpong(const char *name,
+                           unsigned chains,
+                           unsigned idle,
+                           int flags)
 {
-    struct ctx_timer *ctxo = data;
+    unsigned npairs = chains + idle;
+    int (*sv)[2] = malloc(npairs * sizeof(*sv));
+    struct ev_entry **eve = malloc(2 * npairs * sizeof(*eve));
+    struct bench_pp pp = {
+        .ev = ev_new(0),
+        .limit = BENCH_MESSAGES,
+        .lat = malloc((BENCH_MESSAGES + chains) * sizeof(*pp.lat)),
+    };
+    if (!sv || !eve || !pp.ev || !pp.lat) {
+        fprintf(stderr, "Cannot create event handler\n");
+        exit(EXIT_FAILURE);
+    }
 
-    ev_entry_free(ctxo->eve);
-    free(ctxo);
+    for (unsigned i = 0; i < npairs; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv[i]) < 0) {
+            perror("socketpair");
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < 2; j++) {
+            eve[2 * i + j] =
+                ev_entry_new_raw(sv[i][j], EPOLLIN, bench_pp_cb, &pp);
+            if (!eve[2 * i + j] || ev_add(pp.ev, eve[2 * i + j]) != 0) {
+                fprintf(stderr, "Cannot add entry to event handler\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
 
-    fprintf(stderr, "callback called\n");
+    unsigned long long start = ev_now_ns();
+    for (unsigned i = 0; i < chains; i++) {
+        pp.sent++;
+        write(sv[i][0], &start, sizeof(start));
+    }
+    ev_loop(pp.ev, flags);
+    unsigned long long elapsed = ev_now_ns() - start;
+
+    qsort(pp.lat, pp.nlat, sizeof(*pp.lat), bench_cmp);
+    printf("%s: chains %u idle %u%s: %.0f events/s p50 %llu ns p99 %llu ns\n",
+           name, chains, idle, flags & EV_LOOP_BUSY_POLL ? " busy-poll" : "",
+           pp.nlat * 1e9 / elapsed, pp.lat[pp.nlat / 2],
+           pp.lat[pp.nlat * 99 / 100]);
+
+    for (unsigned i = 0; i < 2 * npairs; i++) {
+        ev_del(pp.ev, eve[i]);
+        ev_entry_free(eve[i]);
+    }
+    for (unsigned i = 0; i < npairs; i++) {
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+    ev_destroy(pp.ev);
+    free(pp.lat);
+    free(eve);
+    free(sv);
 }
 
-static void test_timer_oneshot(void)
+static void benchmark(void)
 {
-    int flags = 0, ret;
-    struct ev_entry *eve;
-    struct ctx_timer *ctxo;
-    struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+    unsigned long limit = bench_fd_limit();
 
-    fprintf(stderr, "Test: oneshot timer\n");
+    /* the longest pingpong chain needs a socket pair per link */
+    if (limit < BENCH_FD_SPARE + 2 * BENCH_CHAIN_MAX) {
+        fprintf(stderr, "benchmark: needs %d file descriptors, limit is %lu\n",
+                BENCH_FD_SPARE + 2 * BENCH_CHAIN_MAX, limit);
+        exit(EXIT_FAILURE);
+    }
 
-    struct ev *ev = ev_new(0);
-    if (!ev) {
+    unsigned long fds = limit - BENCH_FD_SPARE;
+    unsigned long timers = BENCH_TIMERS < fds ? BENCH_TIMERS : fds;
+    unsigned idle = BENCH_FANIN_IDLE < fds / 2 ? BENCH_FANIN_IDLE : fds / 2;
+
+    bench_timers(timers);
+
+    unsigned chains[] = {1, 16, BENCH_CHAIN_MAX};
+    for (unsigned i = 0; i < sizeof(chains) / sizeof(chains[0]); i++) {
+        bench_pingpong("pingpong", chains[i], 0, 0);
+        bench_pingpong("pingpong", chains[i], 0,
+                       EV_LOOP_BUSY_POLL | EV_LOOP_ADAPTIVE_BATCH);
+    }
+
+    bench_pingpong("fan-in", BENCH_FANIN_HOT, idle - BENCH_FANIN_HOT, 0);
+}
+
+#define PRIO_LOW_PIPES 3
+
+struct ctx_prio {
+    struct ev *ev;
+    struct ev_entry *eve[PRIO_LOW_PIPES + 1];
+    int pipefd[PRIO_LOW_PIPES + 1][2];
+    unsigned iteration;
+    int order[PRIO_LOW_PIPES + 1];
+    unsigned when[PRIO_LOW_PIPES + 1];
+    int calls;
+};
+
+static void prio_check(void *data)
+{
+    struct ctx_prio *ctx = data;
+    ctx->iteration++;
+}
+
+static void fd_cb_prio(int fd, uint32_t events_ret, void *priv_data)
+{
+    struct ctx_prio *ctx = priv_data;
+    char c;
+
+    (void) events_ret;
+
+    for (int i = 0; i <= PRIO_LOW_PIPES; i++) {
+        if (ctx->pipefd[i][0] != fd)
+            continue;
+        read(fd, &c, 1);
+        ev_del(ctx->ev, ctx->eve[i]);
+        ctx->order[ctx->calls] = i;
+        ctx->when[ctx->calls] = ctx->iteration;
+        ctx->calls++;
+        break;
+    }
+}
+
+/* the high priority entry added last is called first, the edge triggered
+ * low priority entries are spread over iterations by a budget of one */
+void test_priority(void)
+{
+    struct ctx_prio ctx;
+
+    fprintf(stderr, "Test: priorities\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
         fprintf(stderr, "Cannot create event handler\n");
         return;
     }
+    ev_low_priority_budget_set(ctx.ev, 1);
 
-    ctxo = ctx_timer_new();
-    ctxo->ev = ev;
+    for (int i = 0; i <= PRIO_LOW_PIPES; i++) {
+        if (pipe(ctx.pipefd[i]) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        ctx.eve[i] = ev_entry_new_raw(ctx.pipefd[i][0], EPOLLIN | EPOLLET,
+                                      fd_cb_prio, &ctx);
+        if (!ctx.eve[i]) {
+            fprintf(stderr, "Failed to create a ev_entry object\n");
+            exit(EXIT_FAILURE);
+        }
+        ev_entry_priority_set(ctx.eve[i], i == PRIO_LOW_PIPES ? EV_PRIO_HIGH
+                                                              : EV_PRIO_LOW);
+        if (ev_add(ctx.ev, ctx.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+        write(ctx.pipefd[i][1], "1", 1);
+    }
 
-    eve = ev_timer_oneshot_new(&ts, callback_oneshot, ctxo);
-    if (!eve) {
-        fprintf(stderr, "Failed to create a ev_entry object\n");
+    if (ev_check_add(ctx.ev, prio_check, &ctx) != 0) {
+        fprintf(stderr, "Cannot add check callback\n");
         exit(EXIT_FAILURE);
     }
 
-    ctxo->eve = eve;
+    ev_loop(ctx.ev, 0);
+    assert(ctx.calls == PRIO_LOW_PIPES + 1);
+    assert(ctx.order[0] == PRIO_LOW_PIPES);
+    for (int i = 2; i <= PRIO_LOW_PIPES; i++)
+        assert(ctx.when[i] > ctx.when[i - 1]);
 
-    ret = ev_add(ev, eve);
-    if (ret != 0) {
-        fprintf(stderr, "Cannot add entry to event handler\n");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i <= PRIO_LOW_PIPES; i++) {
+        ev_entry_free(ctx.eve[i]);
+        close(ctx.pipefd[i][0]);
+        close(ctx.pipefd[i][1]);
     }
+    ev_destroy(ctx.ev);
+}
 
-    // ev_loop will run until the timeout is fired. Which
-    // in turn is the last event, which will end the ev loop
-    ev_loop(ev, flags);
+/* one batch: the high entry frees a ready low one, a normal one frees
+ * itself, the remaining low one still runs */
+enum { FREE_HIGH, FREE_NORMAL, FREE_VICTIM, FREE_LOW, FREE_PIPES };
 
-    ev_destroy(ev);
+struct ctx_prio_free {
+    struct ev *ev;
+    struct ev_entry *eve[FREE_PIPES];
+    int pipefd[FREE_PIPES][2];
+    int calls[FREE_PIPES];
+};
+
+static void fd_cb_prio_free(int fd, uint32_t events_ret, void *priv_data)
+{
+    struct ctx_prio_free *ctx = priv_data;
+    char c;
+
+    (void) events_ret;
+
+    for (int i = 0; i < FREE_PIPES; i++) {
+        if (ctx->pipefd[i][0] != fd)
+            continue;
+        read(fd, &c, 1);
+        ctx->calls[i]++;
+        if (i == FREE_HIGH) {
+            ev_del(ctx->ev, ctx->eve[FREE_VICTIM]);
+            ev_entry_free(ctx->eve[FREE_VICTIM]);
+            ctx->eve[FREE_VICTIM] = NULL;
+        }
+        ev_del(ctx->ev, ctx->eve[i]);
+        if (i == FREE_NORMAL) {
+            ev_entry_free(ctx->eve[i]);
+            ctx->eve[i] = NULL;
+        }
+        break;
+    }
 }
 
-void callback_timer_periodic(unsigned long long missed, void *data)
+void test_priority_free(void)
 {
-    struct ctx_timer *ctxo = data;
+    static const int prio[FREE_PIPES] = {EV_PRIO_HIGH, EV_PRIO_NORMAL,
+                                         EV_PRIO_LOW, EV_PRIO_LOW};
+    struct ctx_prio_free ctx;
 
-    fprintf(stderr, "callback timer periodic called %d\n", ctxo->periodic_runs);
+    fprintf(stderr, "Test: priorities with entries freed in the batch\n");
 
-    if (missed > 1)
-        fprintf(stderr, "missed timer events: %llu\n", missed - 1);
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
+        fprintf(stderr, "Cannot create event handler\n");
+        return;
+    }
 
-    ctxo->periodic_runs--;
-    if (ctxo->periodic_runs == 0) {
-        // finish, enough testing
-        int ret = ev_timer_cancel(ctxo->ev, ctxo->eve);
-        if (ret < 0) {
-            fprintf(stderr, "failed to cancel timer\n");
+    for (int i = 0; i < FREE_PIPES; i++) {
+        if (pipe(ctx.pipefd[i]) == -1) {
+            perror("pipe");
             exit(EXIT_FAILURE);
         }
-        ev_entry_free(ctxo->eve);
-        free(ctxo);
+        ctx.eve[i] = ev_entry_new_raw(ctx.pipefd[i][0], EPOLLIN,
+                                      fd_cb_prio_free, &ctx);
+        if (!ctx.eve[i]) {
+            fprintf(stderr, "Failed to create a ev_entry object\n");
+            exit(EXIT_FAILURE);
+        }
+        ev_entry_priority_set(ctx.eve[i], prio[i]);
+        if (ev_add(ctx.ev, ctx.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+        write(ctx.pipefd[i][1], "1", 1);
+    }
+
+    ev_loop(ctx.ev, 0);
+    assert(ctx.calls[FREE_HIGH] == 1);
+    assert(ctx.calls[FREE_NORMAL] == 1);
+    assert(ctx.calls[FREE_VICTIM] == 0);
+    assert(ctx.calls[FREE_LOW] == 1);
+
+    for (int i = 0; i < FREE_PIPES; i++) {
+        if (ctx.eve[i])
+            ev_entry_free(ctx.eve[i]);
+        close(ctx.pipefd[i][0]);
+        close(ctx.pipefd[i][1]);
     }
+    ev_destroy(ctx.ev);
 }
 
-static void test_timer_periodic(void)
+#define BACKLOG_PIPES 8
+#define BACKLOG_ROUNDS 1000
+
+struct ctx_backlog {
+    struct ev *ev;
+    struct ev_entry *eve[BACKLOG_PIPES];
+    int pipefd[BACKLOG_PIPES][2];
+    unsigned iteration, calls;
+    int backlog_max;
+};
+
+/* never drained, level triggered entries are reported on every wait */
+static void fd_cb_backlog(int fd, uint32_t events_ret, void *priv_data)
 {
-    int flags = 0;
-    struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+    struct ctx_backlog *ctx = priv_data;
 
-    fprintf(stderr, "Test: periodic timer\n");
+    (void) fd;
+    (void) events_ret;
+    ctx->calls++;
+}
 
-    struct ev *ev = ev_new(0);
-    if (!ev) {
+static void backlog_check(void *data)
+{
+    struct ctx_backlog *ctx = data;
+
+    if (ctx->ev->backlog_len > ctx->backlog_max)
+        ctx->backlog_max = ctx->ev->backlog_len;
+    if (++ctx->iteration < BACKLOG_ROUNDS)
+        return;
+    for (int i = 0; i < BACKLOG_PIPES; i++)
+        ev_del(ctx->ev, ctx->eve[i]);
+}
+
+/* ready low priority entries hold one backlog slot each however often they
+ * are reported while they wait */
+void test_priority_backlog(void)
+{
+    struct ctx_backlog ctx;
+
+    fprintf(stderr, "Test: low priority backlog\n");
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ev = ev_new(0);
+    if (!ctx.ev) {
         fprintf(stderr, "Cannot create event handler\n");
         return;
     }
+    ev_low_priority_budget_set(ctx.ev, 1);
 
-    struct ctx_timer *ctxo = ctx_timer_new();
-    ctxo->ev = ev;
-    ctxo->periodic_runs = 5;
-
-    struct ev_entry *eve =
-        ev_timer_periodic_new(&ts, callback_timer_periodic, ctxo);
-    if (!eve) {
-        fprintf(stderr, "Failed to create a ev_entry object\n");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < BACKLOG_PIPES; i++) {
+        if (pipe(ctx.pipefd[i]) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        ctx.eve[i] = ev_entry_new_raw(ctx.pipefd[i][0], EPOLLIN,
+                                      fd_cb_backlog, &ctx);
+        if (!ctx.eve[i]) {
+            fprintf(stderr, "Failed to create a ev_entry object\n");
+            exit(EXIT_FAILURE);
+        }
+        ev_entry_priority_set(ctx.eve[i], EV_PRIO_LOW);
+        if (ev_add(ctx.ev, ctx.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+        write(ctx.pipefd[i][1], "1", 1);
     }
-    ctxo->eve = eve;
 
-    int ret = ev_add(ev, eve);
-    if (ret != 0) {
-        fprintf(stderr, "Cannot add entry to event handler\n");
+    if (ev_check_add(ctx.ev, backlog_check, &ctx) != 0) {
+        fprintf(stderr, "Cannot add check callback\n");
         exit(EXIT_FAILURE);
     }
 
-    // ev_loop will run until the timeout is fired. Which
-    // in turn is the last event, which will end the ev loop
-    ev_loop(ev, flags);
+    ev_loop(ctx.ev, 0);
+    assert(ctx.backlog_max <= BACKLOG_PIPES);
+    assert(ctx.calls == BACKLOG_ROUNDS);
 
-    ev_destroy(ev);
+    for (int i = 0; i < BACKLOG_PIPES; i++) {
+        ev_entry_free(ctx.eve[i]);
+        close(ctx.pipefd[i][0]);
+        close(ctx.pipefd[i][1]);
+    }
+    ev_destroy(ctx.ev);
 }
 
-static uint32_t events = EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP;
+#define SHARED_WORKERS 4
+#define SHARED_PIPES 64
+#define SHARED_ROUNDS 200
 
-void fd_cb_raw(int fd, uint32_t events_ret, void *priv_data)
+struct ctx_shared {
+    struct ev *ev;
+    int pipefd[SHARED_PIPES][2];
+    struct ev_entry *eve[SHARED_PIPES];
+    int rounds[SHARED_PIPES];
+    int busy[SHARED_PIPES];
+    int calls;
+};
+
+static struct ctx_shared ctx_shared;
+
+static void fd_cb_shared(int fd, uint32_t events, void *data)
 {
-    struct ev *ev = priv_data;
+    long i = (long) data;
+    char c;
 
-    (void) fd;
+    (void) events;
 
-    assert(events == events_ret);
-    ev_run_out(ev);
+    /* EPOLLONESHOT: never two workers in the same entry */
+    if (__atomic_exchange_n(&ctx_shared.busy[i], 1, __ATOMIC_SEQ_CST) != 0) {
+        fprintf(stderr, "Entry dispatched by two workers at once\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (read(fd, &c, 1) != 1) {
+        fprintf(stderr, "Spurious event on pipe %ld\n", i);
+        exit(EXIT_FAILURE);
+    }
+    __atomic_add_fetch(&ctx_shared.calls, 1, __ATOMIC_SEQ_CST);
+
+    __atomic_store_n(&ctx_shared.busy[i], 0, __ATOMIC_SEQ_CST);
+
+    if (++ctx_shared.rounds[i] < SHARED_ROUNDS) {
+        write(ctx_shared.pipefd[i][1], "1", 1);
+        return;
+    }
+
+    /* the dispatching worker still references the entry */
+    ev_del(ctx_shared.ev, ctx_shared.eve[i]);
+    ev_entry_free(ctx_shared.eve[i]);
 }
 
-void test_events_raw(void)
+static void *shared_worker(void *arg)
 {
-    struct ev *ev;
-    int flags = 0, ret;
-    struct ev_entry *eve;
-    int pipefd[2];
+    (void) arg;
+    ev_loop(ctx_shared.ev, 0);
+    return NULL;
+}
 
-    fprintf(stderr, "Test: raw events\n");
+void test_shared(void)
+{
+    pthread_t threads[SHARED_WORKERS];
 
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        exit(EXIT_FAILURE);
-    }
+    fprintf(stderr, "Test: shared workers\n");
 
-    ev = ev_new(0);
-    if (!ev) {
+    memset(&ctx_shared, 0, sizeof(ctx_shared));
+    ctx_shared.ev = ev_new(EV_SHARED);
+    if (!ctx_shared.ev) {
         fprintf(stderr, "Cannot create event handler\n");
         return;
     }
 
-    eve = ev_entry_new_raw(pipefd[0], events, fd_cb_raw, ev);
-    if (!eve) {
-        fprintf(stderr, "Failed to create a ev_entry object\n");
-        exit(EXIT_FAILURE);
+    for (long i = 0; i < SHARED_PIPES; i++) {
+        if (pipe(ctx_shared.pipefd[i]) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        ctx_shared.eve[i] = ev_entry_new_raw(ctx_shared.pipefd[i][0], EPOLLIN,
+                                             fd_cb_shared, (void *) i);
+        if (!ctx_shared.eve[i]) {
+            fprintf(stderr, "Failed to create a ev_entry object\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ev_add(ctx_shared.ev, ctx_shared.eve[i]) != 0) {
+            fprintf(stderr, "Cannot add entry to event handler\n");
+            exit(EXIT_FAILURE);
+        }
+        write(ctx_shared.pipefd[i][1], "1", 1);
     }
 
-    ret = ev_add(ev, eve);
-    if (ret != 0) {
-        fprintf(stderr, "Cannot add entry to event handler\n");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < SHARED_WORKERS; i++) {
+        if (pthread_create(&threads[i], NULL, shared_worker, NULL) != 0) {
+            fprintf(stderr, "Cannot create worker thread\n");
+            exit(EXIT_FAILURE);
+        }
     }
+    for (int i = 0; i < SHARED_WORKERS; i++)
+        pthread_join(threads[i], NULL);
 
-    write(pipefd[1], "1", 1);
-
-    // ev_loop will run until the timeout is fired. Which
-    // in turn is the last event, which will end the ev loop
-    ev_loop(ev, flags);
+    assert(ctx_shared.calls == SHARED_PIPES * SHARED_ROUNDS);
 
-    ev_entry_free(eve);
-    ev_destroy(ev);
+    for (int i = 0; i < SHARED_PIPES; i++) {
+        close(ctx_shared.pipefd[i][0]);
+        close(ctx_shared.pipefd[i][1]);
+    }
+    ev_destroy(ctx_shared.ev);
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    if (argc > 1 && 0 == strcmp(argv[1], OPTION_BENCHMARK)) {
+        benchmark();
+        return EXIT_SUCCESS;
+    }
+
     test_timer_oneshot();
     test_timer_periodic();
     test_timer();
     test_events_raw();
+    test_events_busy_poll_batch();
+    test_defer_coalesce();
+    test_timer_slack();
+    test_stream();
+    test_stream_free_in_drain();
+    test_stream_pipe_idle();
+    test_signal();
+    test_priority();
+    test_priority_free();
+    test_priority_backlog();
+    test_shared();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,424 @@
+/* Throughput and connection rate harness for proxy.exe
+ *
+ * Starts an echo/sink backend in-process, runs ./proxy.exe in front of it
+ * and drives it from several load generator threads over loopback. The
+ * first byte a client sends picks the backend behaviour: 'S' discards
+ * everything (bulk streams), anything else is echoed back (short request
+ * and response exchanges).
+ */
+
+#define _GNU_SOURCE 1
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define err(x) perror(x), exit(1)
+
+#define BACKEND_THREADS 2
+#define BULK_WRITE 65536
+#define REQUEST_SIZE 64
+#define MAX_SAMPLES (1 << 20)
+#define MAX_SWEEP 8
+
+char *proxy_path = "./proxy.exe";
+int base_port = 19000;
+int num_threads = 4;
+int duration = 2;
+bool uring = false;
+
+int chunks[MAX_SWEEP] = {16384, 65536};
+int num_chunks = 2;
+int workers[MAX_SWEEP] = {1, 2};
+int num_workers = 2;
+int pipes[MAX_SWEEP] = {0, 262144};
+int num_pipes = 2;
+
+unsigned long long sink_bytes;
+char bulk_buf[BULK_WRITE];
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct sockaddr_in loopback(int port)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    return addr;
+}
+
+/* Backend: every thread has its own SO_REUSEPORT listener and epoll set.
+ * The connection mode is kept in the low bits of data.u64 next to the fd */
+enum { MODE_NEW, MODE_SINK, MODE_ECHO, MODE_LISTEN };
+
+void *backend_loop(void *arg)
+{
+    int port = (long) arg;
+    struct sockaddr_in addr = loopback(port);
+    struct epoll_event events[64];
+    char buf[BULK_WRITE];
+
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (lfd < 0)
+        err("socket");
+    int opt = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err("backend bind");
+    if (listen(lfd, 1024) < 0)
+        err("backend listen");
+
+    int efd = epoll_create1(0);
+    if (efd < 0)
+        err("epoll_create1");
+    struct epoll_event ev = {.events = EPOLLIN,
+                             .data.u64 = (uint64_t) lfd << 2 | MODE_LISTEN};
+    epoll_ctl(efd, EPOLL_CTL_ADD, lfd, &ev);
+
+    for (;;) {
+        int nfds = epoll_wait(efd, events, 64, -1);
+        for (int i = 0; i < nfds; i++) {
+            int fd = events[i].data.u64 >> 2;
+            int mode = events[i].data.u64 & 3;
+
+            if (mode == MODE_LISTEN) {
+                int cfd;
+                while ((cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    ev.events = EPOLLIN;
+                    ev.data.u64 = (uint64_t) cfd << 2 | MODE_NEW;
+                    epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev);
+                }
+                continue;
+            }
+
+            ssize_t n = read(fd, buf, sizeof(buf));
+            if (n <= 0) {
+                if (n < 0 && errno == EAGAIN)
+                    continue;
+                close(fd);
+                continue;
+            }
+            if (mode == MODE_NEW) {
+                mode = buf[0] == 'S' ? MODE_SINK : MODE_ECHO;
+                ev.events = EPOLLIN;
+                ev.data.u64 = (uint64_t) fd << 2 | mode;
+                epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+            }
+            if (mode == MODE_SINK) {
+                __atomic_add_fetch(&sink_bytes, n, __ATOMIC_RELAXED);
+                continue;
+            }
+            /* requests are tiny, the socket buffer always takes them */
+            if (write(fd, buf, n) != n)
+                close(fd);
+        }
+    }
+    return NULL;
+}
+
+pid_t start_proxy(int chunk, int nworkers, int pipe_size)
+{
+    char port[16], backend_port[16], chunk_s[16], workers_s[16], pipe_s[16];
+
+    snprintf(port, sizeof(port), "%d", base_port);
+    snprintf(backend_port, sizeof(backend_port), "%d", base_port + 1);
+    snprintf(chunk_s, sizeof(chunk_s), "%d", chunk);
+    snprintf(workers_s, sizeof(workers_s), "%d", nworkers);
+    snprintf(pipe_s, sizeof(pipe_s), "%d", pipe_size);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        err("fork");
+    if (pid == 0) {
+        char *argv[] = {proxy_path, "-I", "0", "-j", workers_s, "-b",
+                        chunk_s, "-s", pipe_s, port, "127.0.0.1",
+                        backend_port, "127.0.0.1", NULL, NULL};
+        if (uring) {
+            memmove(&argv[2], &argv[1], 12 * sizeof(char *));
+            argv[1] = "-u";
+        }
+        execv(proxy_path, argv);
+        err("exec proxy");
+    }
+
+    /* wait until it listens */
+    struct sockaddr_in addr = loopback(base_port);
+    for (int i = 0; i < 200; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ret = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+        close(fd);
+        if (ret == 0)
+            return pid;
+        usleep(10000);
+    }
+    fprintf(stderr, "proxy-bench: proxy did not come up\n");
+    exit(1);
+}
+
+/* An io_uring proxy releases its listen socket only once the ring is torn
+ * down, some time after the exit. Wait for the port to be free again */
+void stop_proxy(pid_t pid)
+{
+    struct sockaddr_in addr = loopback(base_port);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    for (int i = 0; i < 200; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        int ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+        close(fd);
+        if (ret == 0)
+            return;
+        usleep(10000);
+    }
+}
+
+int connect_proxy(void)
+{
+    struct sockaddr_in addr = loopback(base_port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    /* reset on close, short runs would exhaust the ports in TIME_WAIT */
+    struct linger lin = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct client {
+    pthread_t thread;
+    uint64_t deadline;
+    uint64_t *samples;
+    int num_samples;
+    unsigned long long requests;
+};
+
+void *bulk_client(void *arg)
+{
+    struct client *c = arg;
+
+    int fd = connect_proxy();
+    if (fd < 0)
+        return NULL;
+    /* a stalled proxy must not block us past the deadline */
+    struct timeval tv = {.tv_usec = 100000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    while (now_ns() < c->deadline) {
+        if (write(fd, bulk_buf, sizeof(bulk_buf)) < 0 && errno != EAGAIN)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+/* connect, one request, one response, close */
+void *short_client(void *arg)
+{
+    struct client *c = arg;
+    char req[REQUEST_SIZE], resp[REQUEST_SIZE];
+
+    memset(req, 'E', sizeof(req));
+    while (now_ns() < c->deadline) {
+        uint64_t start = now_ns();
+        int fd = connect_proxy();
+        if (fd < 0)
+            continue;
+        /* a proxy that never answers must not hang us past the deadline */
+        struct timeval tv = {.tv_usec = 100000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        int got = 0;
+        if (write(fd, req, sizeof(req)) == sizeof(req)) {
+            while (got < REQUEST_SIZE) {
+                ssize_t n = read(fd, resp + got, sizeof(resp) - got);
+                if (n <= 0)
+                    break;
+                got += n;
+            }
+        }
+        close(fd);
+        if (got < REQUEST_SIZE)
+            continue;
+        c->requests++;
+        if (c->num_samples < MAX_SAMPLES)
+            c->samples[c->num_samples++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+double run_bulk(void)
+{
+    struct client clients[num_threads];
+
+    __atomic_store_n(&sink_bytes, 0, __ATOMIC_RELAXED);
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        clients[i].deadline = start + duration * 1000000000ULL;
+        pthread_create(&clients[i].thread, NULL, bulk_client, &clients[i]);
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(clients[i].thread, NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    return __atomic_load_n(&sink_bytes, __ATOMIC_RELAXED) * 8.0 / elapsed;
+}
+
+void run_short(double *rate, double *p99_us)
+{
+    struct client clients[num_threads];
+    unsigned long long requests = 0;
+    int total = 0;
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        clients[i].deadline = start + duration * 1000000000ULL;
+        clients[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        clients[i].num_samples = 0;
+        clients[i].requests = 0;
+        if (!clients[i].samples)
+            err("malloc");
+        pthread_create(&clients[i].thread, NULL, short_client, &clients[i]);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        total += clients[i].num_samples;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t *all = malloc((total + 1) * sizeof(uint64_t));
+    if (!all)
+        err("malloc");
+    int n = 0;
+    for (int i = 0; i < num_threads; i++) {
+        memcpy(all + n, clients[i].samples,
+               clients[i].num_samples * sizeof(uint64_t));
+        n += clients[i].num_samples;
+        free(clients[i].samples);
+    }
+    qsort(all, n, sizeof(uint64_t), cmp_u64);
+
+    *rate = requests * 1e9 / elapsed;
+    *p99_us = n ? all[(int) (n * 0.99)] / 1000.0 : 0;
+    free(all);
+}
+
+int parse_list(char *arg, int *list)
+{
+    int n = 0;
+    for (char *tok = strtok(arg, ","); tok && n < MAX_SWEEP;
+         tok = strtok(NULL, ","))
+        list[n++] = atoi(tok);
+    return n;
+}
+
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: proxy-bench [-x proxy] [-p port] [-t threads] [-d secs]\n"
+            "                   [-b chunks] [-j workers] [-s pipesizes] [-u]\n"
+            "  -b, -j and -s take comma separated lists, every combination\n"
+            "  is measured. Ports port and port + 1 are used. -u runs the\n"
+            "  proxy with its io_uring data path\n");
+    exit(1);
+}
+
+int main(int ac, char **av)
+{
+    int opt;
+    while ((opt = getopt(ac, av, "x:p:t:d:b:j:s:u")) != -1) {
+        switch (opt) {
+        case 'x':
+            proxy_path = optarg;
+            break;
+        case 'p':
+            base_port = atoi(optarg);
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'b':
+            num_chunks = parse_list(optarg, chunks);
+            break;
+        case 'j':
+            num_workers = parse_list(optarg, workers);
+            break;
+        case 's':
+            num_pipes = parse_list(optarg, pipes);
+            break;
+        case 'u':
+            uring = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (num_threads < 1 || duration < 1 || !num_chunks || !num_workers ||
+        !num_pipes)
+        usage();
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(bulk_buf, 'S', sizeof(bulk_buf));
+
+    for (int i = 0; i < BACKEND_THREADS; i++) {
+        pthread_t t;
+        long port = base_port + 1;
+        if (pthread_create(&t, NULL, backend_loop, (void *) port))
+            err("pthread_create");
+    }
+
+    printf("%8s %8s %8s %10s %10s %10s\n", "chunk", "workers", "pipe",
+           "Gbit/s", "conn/s", "p99(us)");
+    for (int b = 0; b < num_chunks; b++) {
+        for (int j = 0; j < num_workers; j++) {
+            for (int s = 0; s < num_pipes; s++) {
+                double gbits, rate, p99;
+                pid_t pid = start_proxy(chunks[b], workers[j], pipes[s]);
+                gbits = run_bulk();
+                run_short(&rate, &p99);
+                stop_proxy(pid);
+                printf("%8d %8d %8d %10.2f %10.0f %10.1f\n", chunks[b],
+                       workers[j], pipes[s], gbits, rate, p99);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
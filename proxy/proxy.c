@@ -5,13 +5,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/io_uring.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
-#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -21,7 +32,94 @@
 #define NEW(x) ((x) = malloc(sizeof(*(x))))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-int connection_timeout = 5; /* FIXME: configurable */
+/* -i, -C, -T: idle, connect and total lifetime timeouts in milliseconds,
+ * 0 turns one off. A pair is idle once neither direction moved data */
+int idle_timeout = 5000;
+int connect_timeout = 5000;
+int lifetime_timeout = 0;
+
+/* -j: each worker has its own SO_REUSEPORT listen socket and epoll set,
+ * the kernel spreads the incoming connections among them */
+int num_workers = 1;
+bool pin_workers = false;
+
+/* -s: F_SETPIPE_SZ for every pipe, 0 keeps the kernel default.
+ * -b: bytes asked for per splice call.
+ * -a: grow chunk and pipe of connections that keep filling them.
+ * pipe_capacity is what the kernel actually makes of -s, the size of the
+ * pipes the pool keeps */
+#define PIPE_MAX_SIZE (1 << 20)
+#define PIPE_POOL_MAX 64
+int pipe_size = 0;
+int pipe_capacity;
+int splice_chunk = 16384;
+bool adapt_pipes = false;
+
+/* -c: reads up to this size go through recv/send and a userspace
+ * buffer. A direction starts that way, switches to splice once a read
+ * fills the buffer, and back after COPY_AFTER short splices in a row.
+ * 0 always splices */
+#define COPY_MAX 65536
+#define COPY_AFTER 8
+int copy_size = 4096;
+
+/* -w: backend connections each worker keeps open ahead of demand */
+int warm_size = 0;
+
+/* -B adds backends to the one given by outhost outport, -L picks the
+ * policy. EJECT_FAILS failed connects in a row take a backend out for
+ * EJECT_SECS, worker 0 probes every backend each -I seconds */
+enum { LB_ROUND_ROBIN, LB_LEAST_CONN, LB_HASH };
+#define MAX_BACKENDS 64
+#define EJECT_FAILS 3
+#define EJECT_SECS 10
+int lb_policy = LB_ROUND_ROBIN;
+int probe_interval = 2;
+
+/* shared by all workers, the counters are atomic */
+struct backend {
+    char *name;
+    struct addrinfo *addr;
+    int active;        /* connections carrying a client */
+    int fails;         /* failed connects in a row */
+    time_t down_until; /* ejected until then */
+};
+
+struct backend backends[MAX_BACKENDS];
+int num_backends;
+
+/* -S: text statistics for whoever connects to this Unix socket */
+char *admin_path;
+
+/* -u: io_uring instead of epoll, where the kernel allows it */
+bool use_uring = false;
+
+/* -U: forward UDP instead of TCP */
+bool udp_mode = false;
+
+/* -l: listen backlog, the kernel caps it at net.core.somaxconn.
+ * -D: TCP_DEFER_ACCEPT seconds, 0 leaves it off */
+#define ACCEPT_BATCH 64
+int listen_backlog = SOMAXCONN;
+int defer_accept = 0;
+
+/* Written by the owning worker only, read by the admin thread */
+enum { DIR_UP, DIR_DOWN }; /* client to backend, backend to client */
+struct stats {
+    unsigned long long active;
+    unsigned long long accepts;
+    unsigned long long bytes[2];
+    unsigned long long splices;
+    unsigned long long copies;
+    unsigned long long eagains;
+    unsigned long long expired;
+};
+
+#define STAT_ADD(w, field, n)                                     \
+    __atomic_store_n(&(w)->stats.field,                           \
+                     __atomic_load_n(&(w)->stats.field,           \
+                                     __ATOMIC_RELAXED) + (n),     \
+                     __ATOMIC_RELAXED)
 
 struct addrinfo *resolve(char *name, char *port, int flags)
 {
@@ -37,169 +135,632 @@ struct addrinfo *resolve(char *name, char *port, int flags)
     return adr;
 }
 
-void setnonblock(int fd, int *cache)
-{
-    int flags;
-    if (!cache || *cache == -1) {
-        flags = fcntl(fd, F_GETFL, 0);
-        if (cache)
-            *cache = flags;
-    } else
-        flags = *cache;
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-}
-
 struct buffer {
     int pipe[2];
     int bytes;
+    int size;  /* pipe capacity */
+    int chunk; /* splice length */
+    bool copy; /* recv/send instead of splice */
+    int small; /* short splices in a row */
 };
 
 struct conn {
     struct conn *other;
     int fd;
     struct buffer buf;
-    time_t expire;
-    struct list_head expire_node;
+    uint64_t born, active;        /* ms, active is the last read */
+    struct list_head expire_node; /* on warm_list while warm */
+    bool dead;                    /* closed, freed after the batch */
+    bool warm;
+    bool probe;              /* health check, closed once connected */
+    bool connected;          /* backend connect completed */
+    struct backend *backend; /* backend side only */
+    uint32_t hash;           /* client address, for LB_HASH */
+    uint32_t events;         /* interest registered with epoll */
+};
+
+/* Coarse timing wheel of WHEEL_SLOTS lists, WHEEL_TICK ms apart.
+ * Activity only records the time. When its slot comes up an entry works
+ * out its real deadline and moves on if it is not due yet, so a busy
+ * connection is moved once per revolution instead of on every event */
+#define WHEEL_TICK 10
+#define WHEEL_SLOTS 512
+
+/* Everything an event loop touches, nothing is shared between workers */
+struct worker {
+    int id;
+    pthread_t thread;
+    int efd, lfd;
+    struct list_head wheel[WHEEL_SLOTS];
+    uint64_t wheel_tick; /* next slot to run, in ticks */
+    uint64_t now_ms;     /* CLOCK_MONOTONIC at the last wakeup */
+    struct list_head dead_list;
+    struct epoll_event *events;
+    int num_events, max_events;
+
+    /* empty pipes of the configured size, ready for the next connection */
+    int pipe_pool[PIPE_POOL_MAX][2];
+    int pipe_pool_len;
+
+    /* idle backend connections, oldest first. A failure holds the refill
+     * back until the next second, a dead backend is not hammered */
+    struct list_head warm_list;
+    int warm_len;
+    time_t warm_retry;
+    unsigned warm_rr;
+
+    unsigned rr;
+    time_t next_probe;
+
+    struct stats stats;
+    char *scratch; /* COPY_MAX bytes for the copy path */
+
+    struct uring *ring;
+    struct udp *udp;
 };
 
-LIST_HEAD(expire_list);
+struct worker *workers;
+
+char *listen_name, *listen_port;
 
 #define MIN_EVENTS 32
-struct epoll_event *events;
-int num_events, max_events;
 
-int epoll_add(int efd, int fd, int revents, void *conn)
+int epoll_add(struct worker *w, int fd, int revents, void *conn)
+{
+    struct epoll_event ev = {.events = revents, .data.ptr = conn};
+    if (++w->num_events >= w->max_events) {
+        w->max_events = MAX(w->max_events * 2, MIN_EVENTS);
+        w->events =
+            realloc(w->events, sizeof(struct epoll_event) * w->max_events);
+    }
+    return epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int epoll_mod(struct worker *w, int fd, int revents, void *conn)
 {
     struct epoll_event ev = {.events = revents, .data.ptr = conn};
-    if (++num_events >= max_events) {
-        max_events = MAX(max_events * 2, MIN_EVENTS);
-        events = realloc(events, sizeof(struct epoll_event) * max_events);
+    return epoll_ctl(w->efd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int epoll_del(struct worker *w, int fd)
+{
+    w->num_events--;
+    assert(w->num_events >= 0);
+    return epoll_ctl(w->efd, EPOLL_CTL_DEL, fd, (void *) 1L);
+}
+
+uint64_t clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(struct worker *w)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+        INIT_LIST_HEAD(&w->wheel[i]);
+    w->now_ms = clock_ms();
+    w->wheel_tick = w->now_ms / WHEEL_TICK;
+}
+
+/* A deadline already passed goes to the next slot to run, one beyond
+ * the wheel's reach comes up early and is put back */
+void wheel_add(struct worker *w, struct list_head *node, uint64_t due)
+{
+    if (due == UINT64_MAX) {
+        INIT_LIST_HEAD(node);
+        return;
+    }
+    uint64_t tick = due / WHEEL_TICK;
+    if (tick < w->wheel_tick)
+        tick = w->wheel_tick;
+    list_add_tail(node, &w->wheel[tick % WHEEL_SLOTS]);
+}
+
+/* Moves everything in the slots that ended by now to due. After a long
+ * sleep a single revolution covers them all */
+void wheel_run(struct worker *w, struct list_head *due)
+{
+    uint64_t end = w->now_ms / WHEEL_TICK;
+    for (int i = 0; i < WHEEL_SLOTS && w->wheel_tick < end; i++)
+        list_splice_tail_init(&w->wheel[w->wheel_tick++ % WHEEL_SLOTS], due);
+    if (w->wheel_tick < end)
+        w->wheel_tick = end;
+}
+
+/* Milliseconds until the first slot with anything in it ends */
+int wheel_next(struct worker *w)
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        uint64_t tick = w->wheel_tick + i;
+        if (list_empty(&w->wheel[tick % WHEEL_SLOTS]))
+            continue;
+        uint64_t end = (tick + 1) * WHEEL_TICK;
+        return end > w->now_ms ? end - w->now_ms : 0;
     }
-    return epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+    return -1;
+}
+
+/* The earliest of the timeouts that apply, UINT64_MAX if none does */
+uint64_t deadline(uint64_t born, uint64_t active, bool connecting)
+{
+    uint64_t due = UINT64_MAX;
+    if (idle_timeout)
+        due = active + idle_timeout;
+    if (lifetime_timeout && born + lifetime_timeout < due)
+        due = born + lifetime_timeout;
+    if (connecting && connect_timeout && born + connect_timeout < due)
+        due = born + connect_timeout;
+    return due;
+}
+
+uint64_t conn_deadline(struct conn *conn)
+{
+    /* a warm one idles by design, only its connect is bounded */
+    if (conn->warm)
+        return connect_timeout ? conn->born + connect_timeout : UINT64_MAX;
+
+    uint64_t active = conn->active;
+    if (conn->other && conn->other->active > active)
+        active = conn->other->active;
+    return deadline(conn->born, active, conn->backend && !conn->connected);
 }
 
-int epoll_del(int efd, int fd)
+/* Apply -s to a fresh pipe and return its real capacity */
+int size_pipe(int fd)
 {
-    num_events--;
-    assert(num_events >= 0);
-    return epoll_ctl(efd, EPOLL_CTL_DEL, fd, (void *) 1L);
+    if (pipe_size) {
+        int ret = fcntl(fd, F_SETPIPE_SZ, pipe_size);
+        if (ret > 0)
+            return ret;
+    }
+    return fcntl(fd, F_GETPIPE_SZ);
 }
 
 /* Create buffer between two connections */
-struct buffer *newbuffer(struct buffer *buf)
+struct buffer *newbuffer(struct worker *w, struct buffer *buf)
 {
+    buf->bytes = 0;
+    buf->size = pipe_capacity;
+    buf->chunk = splice_chunk;
+    buf->copy = copy_size > 0;
+    buf->small = 0;
+
+    if (w->pipe_pool_len > 0) {
+        w->pipe_pool_len--;
+        buf->pipe[0] = w->pipe_pool[w->pipe_pool_len][0];
+        buf->pipe[1] = w->pipe_pool[w->pipe_pool_len][1];
+        return buf;
+    }
+
     if (pipe2(buf->pipe, O_NONBLOCK) < 0) {
         perror("pipe");
         return NULL;
     }
+    buf->size = size_pipe(buf->pipe[1]);
     return buf;
 }
 
-void delbuffer(struct buffer *buf)
+/* Only drained pipes of the configured size are worth keeping */
+void delbuffer(struct worker *w, struct buffer *buf)
 {
+    if (buf->bytes == 0 && buf->size == pipe_capacity &&
+        w->pipe_pool_len < PIPE_POOL_MAX) {
+        w->pipe_pool[w->pipe_pool_len][0] = buf->pipe[0];
+        w->pipe_pool[w->pipe_pool_len][1] = buf->pipe[1];
+        w->pipe_pool_len++;
+        return;
+    }
     close(buf->pipe[0]);
     close(buf->pipe[1]);
 }
 
-void delconn(int efd, struct conn *conn)
+/* A full chunk came in, the sender is faster than one splice per event:
+ * double the chunk and make the pipe large enough to hold it */
+void grow_buffer(struct buffer *buf)
+{
+    if (buf->chunk >= PIPE_MAX_SIZE)
+        return;
+    buf->chunk *= 2;
+    if (buf->chunk <= buf->size)
+        return;
+    int ret = fcntl(buf->pipe[1], F_SETPIPE_SZ, buf->chunk);
+    if (ret < 0) {
+        /* over /proc/sys/fs/pipe-max-size, stay where we are */
+        buf->chunk = buf->size;
+        return;
+    }
+    buf->size = ret;
+}
+
+bool backend_up(struct backend *b, time_t now)
+{
+    return __atomic_load_n(&b->down_until, __ATOMIC_RELAXED) <= now;
+}
+
+void backend_failed(struct backend *b, time_t now)
+{
+    if (__atomic_add_fetch(&b->fails, 1, __ATOMIC_RELAXED) < EJECT_FAILS)
+        return;
+    if (backend_up(b, now))
+        fprintf(stderr, "proxy: backend %s ejected\n", b->name);
+    __atomic_store_n(&b->down_until, now + EJECT_SECS, __ATOMIC_RELAXED);
+}
+
+void backend_ok(struct backend *b, time_t now)
+{
+    __atomic_store_n(&b->fails, 0, __ATOMIC_RELAXED);
+    if (!backend_up(b, now)) {
+        __atomic_store_n(&b->down_until, 0, __ATOMIC_RELAXED);
+        fprintf(stderr, "proxy: backend %s back\n", b->name);
+    }
+}
+
+uint32_t hash_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* When every backend is down try them all anyway, better than nothing.
+ * LB_HASH is rendezvous hashing: a backend going down only moves its own
+ * clients */
+struct backend *pick_backend(struct worker *w, uint32_t hash, time_t now)
+{
+    struct backend *best = NULL;
+    uint32_t best_weight = 0;
+
+    for (int pass = 0; pass < 2 && !best; pass++) {
+        for (int i = 0; i < num_backends; i++) {
+            struct backend *b;
+            uint32_t weight;
+
+            switch (lb_policy) {
+            case LB_ROUND_ROBIN:
+                b = &backends[(w->rr + i) % num_backends];
+                if (pass == 0 && !backend_up(b, now))
+                    continue;
+                w->rr += i + 1;
+                return b;
+            case LB_LEAST_CONN:
+                b = &backends[i];
+                weight = ~__atomic_load_n(&b->active, __ATOMIC_RELAXED);
+                break;
+            default:
+                b = &backends[i];
+                weight = hash_mix(hash ^ hash_mix(i + 1));
+                break;
+            }
+            if (pass == 0 && !backend_up(b, now))
+                continue;
+            if (!best || weight > best_weight) {
+                best = b;
+                best_weight = weight;
+            }
+        }
+    }
+    return best;
+}
+
+/* FNV-1a of the client address without the port */
+uint32_t hash_addr(struct sockaddr_storage *ss)
+{
+    unsigned char *p = NULL;
+    size_t len = 0;
+    uint32_t h = 2166136261u;
+
+    if (ss->ss_family == AF_INET) {
+        p = (unsigned char *) &((struct sockaddr_in *) ss)->sin_addr;
+        len = sizeof(struct in_addr);
+    } else if (ss->ss_family == AF_INET6) {
+        p = (unsigned char *) &((struct sockaddr_in6 *) ss)->sin6_addr;
+        len = sizeof(struct in6_addr);
+    }
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+void delconn(struct worker *w, struct conn *conn)
 {
+    if (!conn->backend)
+        STAT_ADD(w, active, -1);
+    if (conn->backend && !conn->warm && !conn->probe)
+        __atomic_sub_fetch(&conn->backend->active, 1, __ATOMIC_RELAXED);
     list_del(&conn->expire_node);
-    delbuffer(&conn->buf);
-    epoll_del(efd, conn->fd);
+    delbuffer(w, &conn->buf);
+    epoll_del(w, conn->fd);
     close(conn->fd);
-    free(conn);
+
+    /* later events of the batch may still point to it */
+    conn->dead = true;
+    list_add_tail(&conn->expire_node, &w->dead_list);
+}
+
+void reap_conns(struct worker *w)
+{
+    struct conn *conn, *tmp;
+
+    list_for_each_entry_safe (conn, tmp, &w->dead_list, expire_node)
+        free(conn);
+    INIT_LIST_HEAD(&w->dead_list);
 }
 
-struct conn *newconn(int efd, int fd, time_t now)
+struct conn *newconn(struct worker *w,
+                     int fd,
+                     uint32_t events,
+                     struct backend *b)
 {
     struct conn *conn;
     NEW(conn);
     conn->fd = fd;
-    if (!newbuffer(&conn->buf)) {
-        delconn(efd, conn);
+    conn->other = NULL;
+    conn->dead = false;
+    conn->warm = false;
+    conn->probe = false;
+    conn->connected = false;
+    conn->backend = b;
+    conn->hash = 0;
+    INIT_LIST_HEAD(&conn->expire_node);
+    if (!newbuffer(w, &conn->buf)) {
+        close(fd);
+        free(conn);
         return NULL;
     }
-    if (epoll_add(efd, fd, EPOLLIN | EPOLLOUT | EPOLLET, conn) < 0) {
+    conn->events = events | EPOLLET;
+    if (epoll_add(w, fd, conn->events, conn) < 0) {
         perror("epoll");
-        delconn(efd, conn);
+        w->num_events--;
+        delbuffer(w, &conn->buf);
+        close(fd);
+        free(conn);
         return NULL;
     }
-    conn->expire = now + connection_timeout;
-    list_add_tail(&conn->expire_node, &expire_list);
+    conn->born = conn->active = w->now_ms;
+    wheel_add(w, &conn->expire_node, conn_deadline(conn));
     return conn;
 }
 
-/* Process incoming connection. */
-void new_request(int efd, int lfd, int *cache, time_t now)
+/* Drain the accept queue, bounded so a storm cannot starve the
+ * connections already open. The listen socket is level triggered,
+ * whatever is left is reported again on the next epoll_wait */
+void new_request(struct worker *w)
 {
-    int newsk = accept(lfd, NULL, NULL);
-    if (newsk < 0) {
-        perror("accept");
-        return;
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+
+        int newsk = accept4(w->lfd, (struct sockaddr *) &ss, &len,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsk < 0) {
+            /* empty, or another worker won the race for it */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        struct conn *conn = newconn(w, newsk, EPOLLIN, NULL);
+        if (!conn)
+            return;
+        STAT_ADD(w, accepts, 1);
+        STAT_ADD(w, active, 1);
+        if (lb_policy == LB_HASH)
+            conn->hash = hash_addr(&ss);
     }
-    setnonblock(newsk, cache);
-    newconn(efd, newsk, now);
 }
 
 /* Open outgoing connection */
-struct conn *openconn(int efd,
-                      struct addrinfo *host,
-                      int *cache,
+struct conn *openconn(struct worker *w,
+                      struct backend *b,
                       struct conn *other,
                       time_t now)
 {
-    int outfd = socket(host->ai_family, SOCK_STREAM, 0);
+    struct addrinfo *host = b->addr;
+    int outfd =
+        socket(host->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (outfd < 0)
         return NULL;
-    setnonblock(outfd, cache);
     int n = connect(outfd, host->ai_addr, host->ai_addrlen);
     if (n < 0 && errno != EINPROGRESS) {
         perror("connect");
         close(outfd);
+        backend_failed(b, now);
         return NULL;
     }
-    struct conn *conn = newconn(efd, outfd, now);
-    if (conn) {
+    /* EPOLLOUT reports the connect, EPOLLIN a warm one going away */
+    struct conn *conn = newconn(w, outfd, EPOLLIN | EPOLLOUT, b);
+    if (!conn)
+        return NULL;
+    if (other) {
         conn->other = other;
         other->other = conn;
+        __atomic_add_fetch(&b->active, 1, __ATOMIC_RELAXED);
     }
     return conn;
 }
 
-#define BUFSZ 16384 /* FIXME: configurable */
-/* Move from socket to pipe */
-bool move_data_in(int srcfd, struct buffer *buf)
+/* Connect finished one way or the other, passive health tracking */
+void backend_event(struct conn *conn, uint32_t events, time_t now)
 {
-    for (;;) {
-        int n = splice(srcfd, NULL, buf->pipe[1], NULL, BUFSZ,
-                       SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
-        if (n > 0)
-            buf->bytes += n;
-        if (n == 0)
-            return false;
-        if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                return true;
-            return false;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        backend_failed(conn->backend, now);
+    } else if (events & EPOLLOUT) {
+        conn->connected = true;
+        backend_ok(conn->backend, now);
+    }
+}
+
+/* A bare connect to every backend, backend_event() records the outcome */
+void probe_backends(struct worker *w, time_t now)
+{
+    for (int i = 0; i < num_backends; i++) {
+        struct conn *conn = openconn(w, &backends[i], NULL, now);
+        if (conn)
+            conn->probe = true;
+    }
+}
+
+/* Top the warm list up, the connects complete in the background. Until
+ * then a warm connection stays on the wheel under -C, warm_connected()
+ * moves it over to the warm list */
+void refill_warm(struct worker *w, time_t now)
+{
+    if (now < w->warm_retry)
+        return;
+    while (w->warm_len < warm_size) {
+        struct backend *b = &backends[w->warm_rr++ % num_backends];
+        if (!backend_up(b, now))
+            b = pick_backend(w, 0, now);
+        struct conn *conn = openconn(w, b, NULL, now);
+        if (!conn) {
+            w->warm_retry = now + 1;
+            return;
         }
+        conn->warm = true;
+        list_del(&conn->expire_node);
+        wheel_add(w, &conn->expire_node, conn_deadline(conn));
+        w->warm_len++;
     }
-    return true;
+}
+
+void warm_connected(struct worker *w, struct conn *conn)
+{
+    list_del(&conn->expire_node);
+    list_add_tail(&conn->expire_node, &w->warm_list);
+}
+
+/* Closed, reset or unexpectedly talking: not usable for a new client */
+void drop_warm(struct worker *w, struct conn *conn, time_t now)
+{
+    w->warm_len--;
+    w->warm_retry = now + 1;
+    delconn(w, conn);
+}
+
+/* Backend side for a client, a live warm connection to the chosen backend
+ * if there is one */
+struct conn *backend_conn(struct worker *w, struct conn *other, time_t now)
+{
+    struct backend *b = pick_backend(w, other->hash, now);
+    struct conn *conn, *tmp;
+
+    list_for_each_entry_safe (conn, tmp, &w->warm_list, expire_node) {
+        char c;
+        if (conn->backend != b || !conn->connected)
+            continue;
+        if (recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+            (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            drop_warm(w, conn, now);
+            continue;
+        }
+        w->warm_len--;
+        conn->warm = false;
+        conn->other = other;
+        other->other = conn;
+        list_del(&conn->expire_node);
+        conn->born = conn->active = w->now_ms;
+        wheel_add(w, &conn->expire_node, conn_deadline(conn));
+        __atomic_add_fetch(&b->active, 1, __ATOMIC_RELAXED);
+        return conn;
+    }
+    return openconn(w, b, other, now);
+}
+
+/* One splice from the socket into its pipe. Returns the bytes moved,
+ * 0 when there is nothing to read, -1 on EOF or error */
+int move_data_in(struct worker *w, struct conn *src)
+{
+    struct buffer *buf = &src->buf;
+    int dir = src->backend ? DIR_DOWN : DIR_UP;
+
+    int n = splice(src->fd, NULL, buf->pipe[1], NULL, buf->chunk,
+                   SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+    STAT_ADD(w, splices, 1);
+    if (n == 0)
+        return -1;
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            STAT_ADD(w, eagains, 1);
+            return 0;
+        }
+        return -1;
+    }
+    buf->bytes += n;
+    STAT_ADD(w, bytes[dir], n);
+    if (adapt_pipes && n == buf->chunk)
+        grow_buffer(buf);
+    buf->small = n < copy_size ? buf->small + 1 : 0;
+    if (copy_size && buf->small >= COPY_AFTER)
+        buf->copy = true;
+    return n;
+}
+
+/* The copy path, recv into the worker's scratch buffer and send it on
+ * right away. What dst does not take goes into the pipe, empty at this
+ * point, and leaves through move_data_out like spliced data. Returns
+ * like move_data_in */
+int copy_data(struct worker *w, struct conn *src, struct conn *dst)
+{
+    struct buffer *buf = &src->buf;
+    int dir = src->backend ? DIR_DOWN : DIR_UP;
+    int len = copy_size < buf->size ? copy_size : buf->size;
+
+    int n = recv(src->fd, w->scratch, len, 0);
+    STAT_ADD(w, copies, 1);
+    if (n == 0)
+        return -1;
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            STAT_ADD(w, eagains, 1);
+            return 0;
+        }
+        return -1;
+    }
+    STAT_ADD(w, bytes[dir], n);
+
+    int sent = send(dst->fd, w->scratch, n, MSG_NOSIGNAL);
+    STAT_ADD(w, copies, 1);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        STAT_ADD(w, eagains, 1);
+        sent = 0;
+    }
+    if (sent < n) {
+        if (write(buf->pipe[1], w->scratch + sent, n - sent) != n - sent)
+            return -1;
+        buf->bytes = n - sent;
+    }
+
+    /* a full read is a bulk transfer, splice from now on */
+    if (n == len)
+        buf->copy = false;
+    return n;
 }
 
 /* From pipe to socket */
-bool move_data_out(struct buffer *buf, int dstfd)
+bool move_data_out(struct worker *w, struct buffer *buf, int dstfd)
 {
     while (buf->bytes > 0) {
         int bytes = buf->bytes;
-        if (bytes > BUFSZ)
-            bytes = BUFSZ;
+        if (bytes > buf->chunk)
+            bytes = buf->chunk;
         int n = splice(buf->pipe[0], NULL, dstfd, NULL, bytes,
                        SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+        STAT_ADD(w, splices, 1);
         if (n == 0)
             break;
         if (n < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                STAT_ADD(w, eagains, 1);
                 break;
+            }
             return false;
         }
         buf->bytes -= n;
@@ -208,94 +769,191 @@ bool move_data_out(struct buffer *buf, int dstfd)
     return true;
 }
 
-void closeconn(int efd, struct conn *conn)
+/* Moves data from src to dst until src runs dry or dst is full. The
+ * pipe is emptied before every read, and an empty pipe always has room,
+ * so EAGAIN from the read really means src has nothing more */
+bool pump(struct worker *w, struct conn *src, struct conn *dst)
+{
+    for (;;) {
+        if (src->buf.bytes > 0 && !move_data_out(w, &src->buf, dst->fd))
+            return false;
+        if (src->buf.bytes > 0)
+            return true; /* dst is full, its EPOLLOUT resumes */
+        if (src->buf.copy) {
+            int n = copy_data(w, src, dst);
+            if (n <= 0)
+                return n == 0;
+            if (src->buf.bytes > 0)
+                return true;
+            /* TCP hands over all it has queued, a short read that
+             * kept the copy path emptied the socket */
+            if (src->buf.copy)
+                return true;
+            continue;
+        }
+        int n = move_data_in(w, src);
+        if (n <= 0)
+            return n == 0;
+    }
+}
+
+/* Read from a connection only while its pipe is empty, wait for
+ * EPOLLOUT only while the peer's pipe holds data for it or a connect
+ * is pending. EPOLL_CTL_MOD reports a readiness that is already there,
+ * nothing is lost while an event is switched off */
+void rearm(struct worker *w, struct conn *conn)
+{
+    uint32_t events = EPOLLET;
+    if (conn->buf.bytes == 0)
+        events |= EPOLLIN;
+    if ((conn->other && conn->other->buf.bytes > 0) ||
+        (conn->backend && !conn->connected))
+        events |= EPOLLOUT;
+    if (events == conn->events)
+        return;
+    conn->events = events;
+    if (epoll_mod(w, conn->fd, events, conn) < 0)
+        perror("epoll_ctl");
+}
+
+void closeconn(struct worker *w, struct conn *conn)
 {
     if (conn->other)
-        delconn(efd, conn->other);
-    delconn(efd, conn);
+        delconn(w, conn->other);
+    delconn(w, conn);
 }
 
-int expire_connections(int efd, time_t now)
+/* Returns the epoll_wait timeout */
+int expire_connections(struct worker *w, time_t now)
 {
-    struct conn *conn, *tmp;
+    LIST_HEAD(due);
+    wheel_run(w, &due);
 
-    list_for_each_entry_safe (conn, tmp, &expire_list, expire_node) {
-        if (conn->expire > now)
-            return (conn->expire - now) * 1000;
-        closeconn(efd, conn);
+    /* closeconn takes the peer out too, which may be the next one */
+    while (!list_empty(&due)) {
+        struct conn *conn = list_first_entry(&due, struct conn, expire_node);
+        list_del_init(&conn->expire_node);
+        uint64_t when = conn_deadline(conn);
+        if (when > w->now_ms) {
+            wheel_add(w, &conn->expire_node, when);
+            continue;
+        }
+        STAT_ADD(w, expired, 1);
+        if (conn->backend && !conn->connected)
+            backend_failed(conn->backend, now); /* -C ran out */
+        if (conn->warm)
+            drop_warm(w, conn, now);
+        else
+            closeconn(w, conn);
     }
-    return -1;
+    return wheel_next(w);
 }
 
-void touch_conn(struct conn *conn, time_t now)
+/* Data came from conn, no list work on the hot path */
+void touch_conn(struct worker *w, struct conn *conn)
 {
-    conn->expire = now + connection_timeout;
-    list_del(&conn->expire_node);
-    list_add_tail(&conn->expire_node, &expire_list);
+    conn->active = w->now_ms;
 }
 
-int listen_socket(int efd, char *lname, char *port)
+int listen_socket(struct worker *w, char *lname, char *port)
 {
     struct addrinfo *laddr = resolve(lname, port, AI_PASSIVE);
 
-    int lfd = socket(laddr->ai_family, SOCK_STREAM, 0);
+    int type = udp_mode ? SOCK_DGRAM : SOCK_STREAM;
+    int lfd = socket(laddr->ai_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (lfd < 0)
         err("socket");
     int opt = 1;
     if (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) < 0)
         err("SO_REUSEADDR");
+    if (num_workers > 1 &&
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) < 0)
+        err("SO_REUSEPORT");
     if (bind(lfd, laddr->ai_addr, laddr->ai_addrlen) < 0)
         err("bind");
-    if (listen(lfd, 20) < 0)
-        err("listen");
-    setnonblock(lfd, NULL);
     freeaddrinfo(laddr);
 
-    if (epoll_add(efd, lfd, EPOLLIN, NULL) < 0)
+    /* the client's first bytes come with the connection, so it is
+     * never handed out to sit idle in the expire list */
+    if (!udp_mode && defer_accept &&
+        setsockopt(lfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept,
+                   sizeof(int)) < 0)
+        err("TCP_DEFER_ACCEPT");
+    if (!udp_mode && listen(lfd, listen_backlog) < 0)
+        err("listen");
+
+    if (epoll_add(w, lfd, EPOLLIN, NULL) < 0)
         err("epoll add listen fd");
 
     return lfd;
 }
 
-int main(int ac, char **av)
+void pin_worker(struct worker *w)
 {
-    if (ac != 4 && ac != 5) {
-        fprintf(stderr, "Usage: proxy inport outhost outport [listenaddr]\n");
-        exit(1);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret) {
+        errno = ret;
+        perror("pthread_setaffinity_np");
     }
+}
 
-    struct addrinfo *outhost = resolve(av[2], av[3], 0);
-
-    int efd = epoll_create(10);
-    if (efd < 0)
-        err("epoll_create");
-
-    int lfd = listen_socket(efd, av[4] ? av[4] : "0.0.0.0", av[1]);
-
-    int cache_in = -1, cache_out = -1;
+void *worker_loop(void *arg)
+{
+    struct worker *w = arg;
     int timeo = -1;
 
+    if (pin_workers)
+        pin_worker(w);
+
     for (;;) {
-        int nfds = epoll_wait(efd, events, num_events, timeo);
+        int nfds = epoll_wait(w->efd, w->events, w->num_events, timeo);
         if (nfds < 0) {
             perror("epoll");
             continue;
         }
         time_t now = time(NULL);
+        w->now_ms = clock_ms();
 
         for (int i = 0; i < nfds; i++) {
-            struct epoll_event *ev = &events[i];
+            struct epoll_event *ev = &w->events[i];
             struct conn *conn = ev->data.ptr;
 
             /* listen socket */
             if (!conn) {
                 if (ev->events & EPOLLIN)
-                    new_request(efd, lfd, &cache_in, now);
+                    new_request(w);
+                continue;
+            }
+
+            if (conn->dead)
+                continue;
+
+            if (conn->backend && !conn->connected) {
+                backend_event(conn, ev->events, now);
+                if (conn->warm && conn->connected)
+                    warm_connected(w, conn);
+            }
+
+            if (conn->probe) {
+                if (ev->events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                    delconn(w, conn);
+                continue;
+            }
+
+            /* connect completion is fine, anything else kills it */
+            if (conn->warm) {
+                if (ev->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                    drop_warm(w, conn, now);
+                else
+                    rearm(w, conn);
                 continue;
             }
 
             if (ev->events & (EPOLLERR | EPOLLHUP)) {
-                closeconn(efd, conn);
+                closeconn(w, conn);
                 continue;
             }
 
@@ -303,39 +961,1163 @@ int main(int ac, char **av)
 
             /* No attempt for partial close right now */
             if (ev->events & EPOLLIN) {
-                touch_conn(conn, now);
+                touch_conn(w, conn);
                 if (!other)
-                    other = openconn(efd, outhost, &cache_out, conn, now);
-                bool in = move_data_in(conn->fd, &conn->buf);
-                bool out = move_data_out(&conn->buf, other->fd);
-                if (!in || !out) {
-                    closeconn(efd, conn);
+                    other = backend_conn(w, conn, now);
+                if (!other) {
+                    closeconn(w, conn);
+                    continue;
+                }
+                if (!pump(w, conn, other)) {
+                    closeconn(w, conn);
                     continue;
                 }
-                touch_conn(other, now);
             }
 
             if ((ev->events & EPOLLOUT) && other) {
-                if (!move_data_out(&other->buf, conn->fd))
-                    delconn(efd, conn);
-                else
-                    touch_conn(conn, now);
-
-                /* When the pipe filled up could have lost input events.
-                 * Unfortunately, splice does not tell us which end was
-                 * responsible for 0, so we have to ask explicitely.
-                 */
-                int len = 0;
-                if (ioctl(other->fd, FIONREAD, &len) < 0)
-                    perror("ioctl");
-                if (len > 0) {
-                    if (!move_data_in(other->fd, &other->buf))
-                        closeconn(efd, other);
+                if (!move_data_out(w, &other->buf, conn->fd)) {
+                    closeconn(w, conn);
+                    continue;
                 }
+                touch_conn(w, other);
+
+                /* the peer stopped reading on a full pipe */
+                if (other->buf.bytes == 0 && !pump(w, other, conn)) {
+                    closeconn(w, other);
+                    continue;
+                }
+            }
+
+            rearm(w, conn);
+            if (conn->other)
+                rearm(w, conn->other);
+        }
+
+        /* before the expiry, which accounts for the new connects */
+        if (warm_size)
+            refill_warm(w, now);
+
+        timeo = expire_connections(w, now);
+        reap_conns(w);
+
+        if (warm_size && w->warm_len < warm_size &&
+            (timeo < 0 || timeo > 1000))
+            timeo = 1000;
+
+        if (probe_interval && w->id == 0) {
+            if (now >= w->next_probe) {
+                probe_backends(w, now);
+                w->next_probe = now + probe_interval;
             }
+            int left = (w->next_probe - now) * 1000;
+            if (timeo < 0 || timeo > left)
+                timeo = left;
+        }
+    }
+    return NULL;
+}
+
+void sum_stats(struct stats *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < num_workers; i++) {
+        struct stats *st = &workers[i].stats;
+#define SUM(field) sum->field += __atomic_load_n(&st->field, __ATOMIC_RELAXED)
+        SUM(active);
+        SUM(accepts);
+        SUM(bytes[DIR_UP]);
+        SUM(bytes[DIR_DOWN]);
+        SUM(splices);
+        SUM(copies);
+        SUM(eagains);
+        SUM(expired);
+#undef SUM
+    }
+}
+
+void write_stats(int fd, unsigned long long accept_rate)
+{
+    struct stats st;
+    char text[4096];
+    time_t now = time(NULL);
+
+    sum_stats(&st);
+    unsigned long long bytes = st.bytes[DIR_UP] + st.bytes[DIR_DOWN];
+    int len = snprintf(
+        text, sizeof(text),
+        "active %llu\n"
+        "accepts %llu\n"
+        "accepts_per_sec %llu\n"
+        "bytes_client_to_backend %llu\n"
+        "bytes_backend_to_client %llu\n"
+        "splice_calls %llu\n"
+        "splice_calls_per_mb %.1f\n"
+        "copy_calls %llu\n"
+        "splice_eagain %llu\n"
+        "splice_eagain_pct %.1f\n"
+        "expiry_closes %llu\n",
+        st.active, st.accepts, accept_rate, st.bytes[DIR_UP],
+        st.bytes[DIR_DOWN], st.splices,
+        bytes ? st.splices * 1048576.0 / bytes : 0.0, st.copies, st.eagains,
+        st.splices ? st.eagains * 100.0 / st.splices : 0.0, st.expired);
+    for (int i = 0; i < num_backends && len < (int) sizeof(text); i++) {
+        struct backend *b = &backends[i];
+        len += snprintf(text + len, sizeof(text) - len,
+                        "backend %s active %d fails %d up %d\n", b->name,
+                        __atomic_load_n(&b->active, __ATOMIC_RELAXED),
+                        __atomic_load_n(&b->fails, __ATOMIC_RELAXED),
+                        backend_up(b, now));
+    }
+    if (len > (int) sizeof(text))
+        len = sizeof(text);
+    if (write(fd, text, len) < 0)
+        perror("admin write");
+}
+
+/* One reply per connection, then close. Samples the accept counter once a
+ * second for the rate */
+void *admin_loop(void *arg)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stats st;
+    unsigned long long last_accepts = 0, accept_rate = 0;
+    time_t last = time(NULL);
+
+    (void) arg;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        err("admin socket");
+    strncpy(addr.sun_path, admin_path, sizeof(addr.sun_path) - 1);
+    unlink(admin_path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err("admin bind");
+    if (listen(fd, 8) < 0)
+        err("admin listen");
+
+    for (;;) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int n = poll(&pfd, 1, 1000);
+
+        time_t now = time(NULL);
+        if (now != last) {
+            sum_stats(&st);
+            accept_rate = (st.accepts - last_accepts) / (now - last);
+            last_accepts = st.accepts;
+            last = now;
         }
 
-        timeo = expire_connections(efd, now);
+        if (n <= 0)
+            continue;
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd < 0)
+            continue;
+        write_stats(cfd, accept_rate);
+        close(cfd);
+    }
+    return NULL;
+}
+
+/* io_uring data path, -u
+ *
+ * Multishot accept hands out client sockets, IORING_OP_CONNECT opens the
+ * backend side. Each direction then runs the hard-linked chain
+ *
+ *   POLL_ADD(src, POLLIN) -> SPLICE(src -> pipe) -> SPLICE(pipe -> dst)
+ *
+ * and everything a loop iteration queued goes to the kernel with the
+ * single io_uring_enter that also waits for the next completions. Both
+ * splices are SPLICE_F_NONBLOCK on the pipe side and the sockets are
+ * O_NONBLOCK, so an io-wq worker running a splice never sleeps: after EOF
+ * or a short read the chain ends with EAGAIN, and whatever a full socket
+ * did not take waits for POLLOUT before it is flushed.
+ * Closing shuts both sockets down, which completes whatever is in flight,
+ * and the fds are only closed after the last completion, so a reused fd
+ * number can never be hit by a pending operation. Warm connections and
+ * active probes are epoll-only.
+ */
+
+#define URING_ENTRIES 4096
+
+/* low bits of user_data, the rest is the pair */
+enum {
+    UR_ACCEPT,
+    UR_TIMEOUT,
+    UR_CONNECT,
+    UR_POLL,
+    UR_SPLICE_IN,
+    UR_SPLICE_OUT,
+};
+#define UR_DIR 8
+#define UR_MASK 15
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, to_submit;
+    bool multishot;
+    struct __kernel_timespec tick;
+};
+
+/* fd[0] is the client, buf[dir] carries fd[dir] to fd[!dir] */
+struct upair {
+    int fd[2];
+    struct buffer buf[2];
+    int pending[2];
+    int inflight;
+    bool connected, closing;
+    struct backend *backend;
+    uint64_t born, active;
+    struct list_head expire_node;
+};
+
+int uring_setup(struct uring *r)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *ring = mmap(NULL, MAX(sq_size, cq_size), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+        goto err_fd;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err_fd;
+
+    r->sq_head = (unsigned *) (ring + p.sq_off.head);
+    r->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (ring + p.sq_off.array);
+    r->cq_head = (unsigned *) (ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->to_submit = 0;
+    r->multishot = true;
+    return 0;
+
+err_fd:
+    close(r->fd);
+    return -1;
+}
+
+int uring_enter(struct uring *r, unsigned min_complete)
+{
+    int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret >= 0)
+        r->to_submit -= ret;
+    return ret;
+}
+
+/* Next free SQE, the ring is only pushed to the kernel when it is full */
+struct io_uring_sqe *uring_sqe(struct uring *r, uint64_t user_data)
+{
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+           r->sq_entries) {
+        if (uring_enter(r, 0) < 0 && errno != EINTR && errno != EBUSY)
+            err("io_uring_enter");
+    }
+
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+void uring_accept(struct worker *w)
+{
+    struct io_uring_sqe *sqe = uring_sqe(w->ring, UR_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->lfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (w->ring->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Drives expiry: wakes up for the first busy slot of the wheel, but
+ * never later than the shortest timeout, a pair opened meanwhile may
+ * be due that soon, and at least once a second */
+void uring_tick(struct worker *w)
+{
+    int ms = 1000;
+    int next = wheel_next(w);
+    if (next >= 0 && next < ms)
+        ms = next;
+    if (idle_timeout && idle_timeout < ms)
+        ms = idle_timeout;
+    if (connect_timeout && connect_timeout < ms)
+        ms = connect_timeout;
+    if (lifetime_timeout && lifetime_timeout < ms)
+        ms = lifetime_timeout;
+    ms = MAX(ms, 1);
+    w->ring->tick.tv_sec = ms / 1000;
+    w->ring->tick.tv_nsec = (ms % 1000) * 1000000L;
+    struct io_uring_sqe *sqe = uring_sqe(w->ring, UR_TIMEOUT);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &w->ring->tick;
+    sqe->len = 1;
+}
+
+struct io_uring_sqe *upair_sqe(struct worker *w,
+                               struct upair *p,
+                               int op,
+                               int dir)
+{
+    p->inflight++;
+    if (op == UR_POLL || op == UR_SPLICE_IN || op == UR_SPLICE_OUT)
+        p->pending[dir]++;
+    return uring_sqe(w->ring, (uintptr_t) p | op | (dir ? UR_DIR : 0));
+}
+
+void upair_splice(struct io_uring_sqe *sqe, int in, int out, int len)
+{
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = out;
+    sqe->off = -1;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_NONBLOCK | SPLICE_F_MOVE;
+}
+
+void upair_chain(struct worker *w, struct upair *p, int dir)
+{
+    struct buffer *buf = &p->buf[dir];
+    int src = p->fd[dir], dst = p->fd[!dir];
+
+    struct io_uring_sqe *sqe = upair_sqe(w, p, UR_POLL, dir);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = src;
+    sqe->poll32_events = POLLIN;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = upair_sqe(w, p, UR_SPLICE_IN, dir);
+    upair_splice(sqe, src, buf->pipe[1], buf->chunk);
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = upair_sqe(w, p, UR_SPLICE_OUT, dir);
+    upair_splice(sqe, buf->pipe[0], dst, buf->chunk);
+}
+
+/* the socket took less than the pipe had */
+void upair_flush(struct worker *w, struct upair *p, int dir)
+{
+    struct buffer *buf = &p->buf[dir];
+    int dst = p->fd[!dir];
+
+    struct io_uring_sqe *sqe = upair_sqe(w, p, UR_POLL, dir);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = dst;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_HARDLINK;
+
+    sqe = upair_sqe(w, p, UR_SPLICE_OUT, dir);
+    upair_splice(sqe, buf->pipe[0], dst, buf->bytes);
+}
+
+void upair_free(struct worker *w, struct upair *p)
+{
+    for (int i = 0; i < 2; i++) {
+        if (p->fd[i] >= 0)
+            close(p->fd[i]);
+        if (p->buf[i].pipe[0] >= 0) {
+            close(p->buf[i].pipe[0]);
+            close(p->buf[i].pipe[1]);
+        }
+    }
+    if (p->connected)
+        __atomic_sub_fetch(&p->backend->active, 1, __ATOMIC_RELAXED);
+    STAT_ADD(w, active, -1);
+    free(p);
+}
+
+/* Completes everything in flight, the last completion frees */
+void upair_close(struct worker *w, struct upair *p)
+{
+    if (p->closing)
+        return;
+    p->closing = true;
+    list_del(&p->expire_node);
+    for (int i = 0; i < 2; i++) {
+        if (p->fd[i] >= 0)
+            shutdown(p->fd[i], SHUT_RDWR);
+    }
+    if (!p->inflight)
+        upair_free(w, p);
+}
+
+/* Pipes for io_uring are blocking ones of their own, the pool only keeps
+ * O_NONBLOCK pipes */
+bool upair_pipe(struct buffer *buf)
+{
+    buf->bytes = 0;
+    buf->chunk = splice_chunk;
+    if (pipe2(buf->pipe, O_CLOEXEC) < 0) {
+        buf->pipe[0] = buf->pipe[1] = -1;
+        return false;
+    }
+    buf->size = size_pipe(buf->pipe[1]);
+    if (buf->chunk > buf->size)
+        buf->chunk = buf->size;
+    return true;
+}
+
+void upair_open(struct worker *w, int fd, time_t now)
+{
+    struct upair *p;
+    NEW(p);
+    if (!p) {
+        close(fd);
+        return;
+    }
+    memset(p, 0, sizeof(*p));
+    p->fd[0] = fd;
+    p->fd[1] = -1;
+    p->buf[0].pipe[0] = p->buf[1].pipe[0] = -1;
+    p->born = p->active = w->now_ms;
+    wheel_add(w, &p->expire_node, deadline(p->born, p->active, true));
+    STAT_ADD(w, accepts, 1);
+    STAT_ADD(w, active, 1);
+
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    uint32_t hash = 0;
+    if (lb_policy == LB_HASH &&
+        getpeername(fd, (struct sockaddr *) &ss, &len) == 0)
+        hash = hash_addr(&ss);
+
+    p->backend = pick_backend(w, hash, now);
+    struct addrinfo *host = p->backend->addr;
+    p->fd[1] =
+        socket(host->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p->fd[1] < 0 || !upair_pipe(&p->buf[0]) || !upair_pipe(&p->buf[1])) {
+        perror("proxy");
+        upair_close(w, p);
+        return;
+    }
+
+    struct io_uring_sqe *sqe = upair_sqe(w, p, UR_CONNECT, 0);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = p->fd[1];
+    sqe->addr = (uintptr_t) host->ai_addr;
+    sqe->off = host->ai_addrlen;
+}
+
+void upair_complete(struct worker *w,
+                    struct upair *p,
+                    int op,
+                    int dir,
+                    int res,
+                    time_t now)
+{
+    struct buffer *buf = &p->buf[dir];
+
+    p->inflight--;
+    if (op != UR_CONNECT)
+        p->pending[dir]--;
+
+    if (p->closing) {
+        if (!p->inflight)
+            upair_free(w, p);
+        return;
+    }
+
+    switch (op) {
+    case UR_CONNECT:
+        if (res < 0) {
+            backend_failed(p->backend, now);
+            upair_close(w, p);
+            return;
+        }
+        backend_ok(p->backend, now);
+        p->connected = true;
+        __atomic_add_fetch(&p->backend->active, 1, __ATOMIC_RELAXED);
+        upair_chain(w, p, 0);
+        upair_chain(w, p, 1);
+        return;
+    case UR_POLL:
+        if (res < 0) {
+            upair_close(w, p);
+            return;
+        }
+        break;
+    case UR_SPLICE_IN:
+        STAT_ADD(w, splices, 1);
+        if (res == -EAGAIN) {
+            STAT_ADD(w, eagains, 1);
+            break;
+        }
+        /* no half close, like the epoll path */
+        if (res <= 0) {
+            upair_close(w, p);
+            return;
+        }
+        buf->bytes += res;
+        STAT_ADD(w, bytes[dir ? DIR_DOWN : DIR_UP], res);
+        p->active = w->now_ms;
+        break;
+    case UR_SPLICE_OUT:
+        STAT_ADD(w, splices, 1);
+        if (res == -EAGAIN) {
+            STAT_ADD(w, eagains, 1);
+            break;
+        }
+        if (res < 0) {
+            upair_close(w, p);
+            return;
+        }
+        buf->bytes -= res;
+        break;
+    }
+
+    if (p->pending[dir])
+        return;
+    if (buf->bytes > 0)
+        upair_flush(w, p, dir);
+    else
+        upair_chain(w, p, dir);
+}
+
+void uring_expire(struct worker *w, time_t now)
+{
+    LIST_HEAD(due);
+    wheel_run(w, &due);
+
+    while (!list_empty(&due)) {
+        struct upair *p = list_first_entry(&due, struct upair, expire_node);
+        list_del_init(&p->expire_node);
+        uint64_t when = deadline(p->born, p->active, !p->connected);
+        if (when > w->now_ms) {
+            wheel_add(w, &p->expire_node, when);
+            continue;
+        }
+        STAT_ADD(w, expired, 1);
+        if (!p->connected)
+            backend_failed(p->backend, now);
+        upair_close(w, p);
+    }
+}
+
+void uring_cqe(struct worker *w, struct io_uring_cqe *cqe, time_t now)
+{
+    int op = cqe->user_data & (UR_MASK & ~UR_DIR);
+    int dir = !!(cqe->user_data & UR_DIR);
+    struct upair *p = (struct upair *) (uintptr_t) (cqe->user_data & ~UR_MASK);
+
+    switch (op) {
+    case UR_ACCEPT:
+        if (cqe->res >= 0)
+            upair_open(w, cqe->res, now);
+        else if (cqe->res == -EINVAL && w->ring->multishot)
+            w->ring->multishot = false; /* kernel before 5.19 */
+        else if (cqe->res != -EAGAIN && cqe->res != -EINTR)
+            fprintf(stderr, "proxy: accept: %s\n", strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uring_accept(w);
+        break;
+    case UR_TIMEOUT:
+        uring_expire(w, now);
+        uring_tick(w);
+        break;
+    default:
+        upair_complete(w, p, op, dir, cqe->res, now);
+    }
+}
+
+void *uring_loop(void *arg)
+{
+    struct worker *w = arg;
+
+    if (pin_workers)
+        pin_worker(w);
+
+    /* the ring does its own waiting, blocking accept is fine */
+    int flags = fcntl(w->lfd, F_GETFL, 0);
+    fcntl(w->lfd, F_SETFL, flags & ~O_NONBLOCK);
+
+    uring_accept(w);
+    uring_tick(w);
+
+    for (;;) {
+        if (uring_enter(w->ring, 1) < 0 && errno != EINTR && errno != EBUSY &&
+            errno != ETIME)
+            err("io_uring_enter");
+
+        time_t now = time(NULL);
+        w->now_ms = clock_ms();
+        unsigned head = *w->ring->cq_head;
+        unsigned tail = __atomic_load_n(w->ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe =
+                &w->ring->cqes[head & *w->ring->cq_mask];
+            uring_cqe(w, cqe, now);
+        }
+        __atomic_store_n(w->ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* UDP forwarding, -U
+ *
+ * Every client address gets a session with a socket of its own,
+ * connected to the backend picked for it, so replies come back on that
+ * socket and only need the client address put on them. Sessions live in
+ * a hash table per worker: with -j the kernel sends a client to the same
+ * SO_REUSEPORT socket every time, so a session never spans workers.
+ * Datagrams move UDP_BATCH at a time with recvmmsg/sendmmsg. Where the
+ * kernel has UDP_GRO it hands over a run of same sized datagrams as one
+ * buffer, and UDP_SEGMENT cuts it up the same way on the way out.
+ * Sessions expire by the idle and lifetime timeouts. Both kinds of
+ * socket are level triggered, one batch per event keeps things fair.
+ */
+
+#define UDP_BATCH 32
+#define UDP_BUF 65536
+#define UDP_BUCKETS 4096
+
+struct usess {
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+    uint32_t hash;
+    int fd;
+    struct backend *backend;
+    uint64_t born, active;
+    struct list_head expire_node;
+    bool dead;
+    struct usess *next; /* hash chain */
+};
+
+struct udp {
+    struct usess *buckets[UDP_BUCKETS];
+    bool gro;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    char ctl[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    char *bufs; /* UDP_BATCH times UDP_BUF */
+};
+
+/* the LB_HASH hash of the address, mixed with the port */
+uint32_t udp_hash(struct sockaddr_storage *ss)
+{
+    uint16_t port = ss->ss_family == AF_INET6
+                        ? ((struct sockaddr_in6 *) ss)->sin6_port
+                        : ((struct sockaddr_in *) ss)->sin_port;
+    return hash_mix(hash_addr(ss) ^ port);
+}
+
+void udp_setup(struct worker *w)
+{
+    NEW(w->udp);
+    if (!w->udp)
+        err("malloc");
+    memset(w->udp, 0, sizeof(*w->udp));
+    w->udp->bufs = malloc(UDP_BATCH * UDP_BUF);
+    if (!w->udp->bufs)
+        err("malloc");
+    int opt = 1;
+    w->udp->gro =
+        setsockopt(w->lfd, SOL_UDP, UDP_GRO, &opt, sizeof(int)) == 0;
+}
+
+/* Freed by udp_reap(), later events of the batch may still point to it */
+void udp_close(struct worker *w, struct usess *s)
+{
+    struct usess **pp = &w->udp->buckets[s->hash % UDP_BUCKETS];
+    while (*pp != s)
+        pp = &(*pp)->next;
+    *pp = s->next;
+    epoll_del(w, s->fd);
+    close(s->fd);
+    STAT_ADD(w, active, -1);
+    __atomic_sub_fetch(&s->backend->active, 1, __ATOMIC_RELAXED);
+    s->dead = true;
+    list_del(&s->expire_node);
+    list_add_tail(&s->expire_node, &w->dead_list);
+}
+
+void udp_reap(struct worker *w)
+{
+    struct usess *s, *tmp;
+    list_for_each_entry_safe (s, tmp, &w->dead_list, expire_node)
+        free(s);
+    INIT_LIST_HEAD(&w->dead_list);
+}
+
+
+/* Looks the client up, a new one gets a backend and a socket */
+struct usess *udp_session(struct worker *w,
+                          struct sockaddr_storage *ss,
+                          socklen_t len,
+                          time_t now)
+{
+    uint32_t hash = udp_hash(ss);
+    struct usess **bucket = &w->udp->buckets[hash % UDP_BUCKETS];
+
+    for (struct usess *s = *bucket; s; s = s->next) {
+        if (s->hash == hash && s->peerlen == len && !memcmp(&s->peer, ss, len))
+            return s;
+    }
+
+    struct backend *b = pick_backend(w, hash_addr(ss), now);
+    struct addrinfo *host = b->addr;
+    int fd =
+        socket(host->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    if (connect(fd, host->ai_addr, host->ai_addrlen) < 0) {
+        perror("connect");
+        close(fd);
+        backend_failed(b, now);
+        return NULL;
+    }
+    int opt = 1;
+    if (w->udp->gro)
+        setsockopt(fd, SOL_UDP, UDP_GRO, &opt, sizeof(int));
+
+    struct usess *s;
+    NEW(s);
+    if (!s) {
+        close(fd);
+        return NULL;
+    }
+    if (epoll_add(w, fd, EPOLLIN, s) < 0) {
+        perror("epoll");
+        w->num_events--;
+        close(fd);
+        free(s);
+        return NULL;
+    }
+    memcpy(&s->peer, ss, len);
+    s->peerlen = len;
+    s->hash = hash;
+    s->fd = fd;
+    s->backend = b;
+    s->born = s->active = w->now_ms;
+    s->dead = false;
+    wheel_add(w, &s->expire_node, deadline(s->born, s->active, false));
+    s->next = *bucket;
+    *bucket = s;
+    STAT_ADD(w, accepts, 1);
+    STAT_ADD(w, active, 1);
+    __atomic_add_fetch(&b->active, 1, __ATOMIC_RELAXED);
+    return s;
+}
+
+/* Receives one batch from fd, the source addresses only if asked for */
+int udp_recv(struct worker *w, int fd, bool addrs)
+{
+    struct udp *u = w->udp;
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+        struct msghdr *mh = &u->msgs[i].msg_hdr;
+        u->iov[i].iov_base = u->bufs + i * UDP_BUF;
+        u->iov[i].iov_len = UDP_BUF;
+        mh->msg_iov = &u->iov[i];
+        mh->msg_iovlen = 1;
+        mh->msg_name = addrs ? &u->addrs[i] : NULL;
+        mh->msg_namelen = addrs ? sizeof(u->addrs[i]) : 0;
+        mh->msg_control = u->gro ? u->ctl[i] : NULL;
+        mh->msg_controllen = u->gro ? sizeof(u->ctl[i]) : 0;
+        mh->msg_flags = 0;
+    }
+    int n = recvmmsg(fd, u->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0 && errno == EAGAIN)
+        STAT_ADD(w, eagains, 1);
+    return n;
+}
+
+/* Turns a received message into one to send. A GRO buffer holds
+ * datagrams of gso_size bytes, the last one maybe shorter, its UDP_GRO
+ * cmsg becomes a UDP_SEGMENT one */
+void udp_outgoing(struct mmsghdr *m, void *name, socklen_t namelen)
+{
+    struct msghdr *mh = &m->msg_hdr;
+    int gso = 0;
+
+    mh->msg_iov->iov_len = m->msg_len;
+    mh->msg_name = name;
+    mh->msg_namelen = namelen;
+    if (mh->msg_control) {
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(mh); c; c = CMSG_NXTHDR(mh, c))
+            if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO)
+                memcpy(&gso, CMSG_DATA(c), sizeof(int));
+    }
+    if (gso <= 0 || m->msg_len <= (unsigned) gso) {
+        mh->msg_control = NULL;
+        mh->msg_controllen = 0;
+        return;
+    }
+    uint16_t seg = gso;
+    mh->msg_controllen = CMSG_SPACE(sizeof(seg));
+    struct cmsghdr *c = CMSG_FIRSTHDR(mh);
+    c->cmsg_level = SOL_UDP;
+    c->cmsg_type = UDP_SEGMENT;
+    c->cmsg_len = CMSG_LEN(sizeof(seg));
+    memcpy(CMSG_DATA(c), &seg, sizeof(seg));
+}
+
+/* Sends n prepared messages, what the socket does not take is dropped.
+ * Returns false on an error that is not just a full buffer */
+bool udp_send(struct worker *w, int fd, struct mmsghdr *msgs, int n, int dir)
+{
+    for (int i = 0; i < n; i++)
+        STAT_ADD(w, bytes[dir], msgs[i].msg_len);
+    int sent = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+    if (sent < 0 && errno != EAGAIN && errno != ENOBUFS)
+        return false;
+    if (sent < n)
+        STAT_ADD(w, eagains, 1);
+    return true;
+}
+
+/* Client datagrams, each run from the same client is one sendmmsg */
+void udp_upstream(struct worker *w, time_t now)
+{
+    struct udp *u = w->udp;
+    int n = udp_recv(w, w->lfd, true);
+
+    for (int i = 0, j; i < n; i = j) {
+        struct msghdr *first = &u->msgs[i].msg_hdr;
+        for (j = i + 1; j < n; j++) {
+            struct msghdr *mh = &u->msgs[j].msg_hdr;
+            if (mh->msg_namelen != first->msg_namelen ||
+                memcmp(mh->msg_name, first->msg_name, mh->msg_namelen))
+                break;
+        }
+        struct usess *s =
+            udp_session(w, first->msg_name, first->msg_namelen, now);
+        if (!s)
+            continue;
+        s->active = w->now_ms;
+        for (int k = i; k < j; k++)
+            udp_outgoing(&u->msgs[k], NULL, 0);
+        if (!udp_send(w, s->fd, &u->msgs[i], j - i, DIR_UP)) {
+            /* ICMP unreachable from an earlier datagram */
+            backend_failed(s->backend, now);
+            udp_close(w, s);
+        }
+    }
+}
+
+/* Backend replies, all of them go to the session's client */
+void udp_downstream(struct worker *w, struct usess *s, time_t now)
+{
+    struct udp *u = w->udp;
+    int n = udp_recv(w, s->fd, false);
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            backend_failed(s->backend, now);
+            udp_close(w, s);
+        }
+        return;
+    }
+    backend_ok(s->backend, now);
+    s->active = w->now_ms;
+    for (int i = 0; i < n; i++)
+        udp_outgoing(&u->msgs[i], &s->peer, s->peerlen);
+    udp_send(w, w->lfd, u->msgs, n, DIR_DOWN);
+}
+
+/* Returns the epoll_wait timeout */
+int udp_expire(struct worker *w)
+{
+    LIST_HEAD(due);
+    wheel_run(w, &due);
+
+    while (!list_empty(&due)) {
+        struct usess *s = list_first_entry(&due, struct usess, expire_node);
+        list_del_init(&s->expire_node);
+        uint64_t when = deadline(s->born, s->active, false);
+        if (when > w->now_ms) {
+            wheel_add(w, &s->expire_node, when);
+            continue;
+        }
+        STAT_ADD(w, expired, 1);
+        udp_close(w, s);
+    }
+    return wheel_next(w);
+}
+
+void *udp_loop(void *arg)
+{
+    struct worker *w = arg;
+    int timeo = -1;
+
+    if (pin_workers)
+        pin_worker(w);
+
+    for (;;) {
+        int nfds = epoll_wait(w->efd, w->events, w->num_events, timeo);
+        if (nfds < 0) {
+            perror("epoll");
+            continue;
+        }
+        time_t now = time(NULL);
+        w->now_ms = clock_ms();
+
+        for (int i = 0; i < nfds; i++) {
+            struct usess *s = w->events[i].data.ptr;
+            if (!s)
+                udp_upstream(w, now);
+            else if (!s->dead)
+                udp_downstream(w, s, now);
+        }
+        timeo = udp_expire(w);
+        udp_reap(w);
+    }
+    return NULL;
+}
+
+void usage(void)
+{
+    fprintf(stderr,
+            "Usage: proxy [-j workers] [-p] [-s pipesize] [-b chunk] [-a]\n"
+            "             [-w warm] [-B host:port]... [-L policy] [-I secs]\n"
+            "             [-S path] [-u] [-l backlog] [-D secs] [-c bytes]\n"
+            "             [-U] [-i ms] [-C ms] [-T ms]\n"
+            "             inport outhost outport [listenaddr]\n"
+            "  -j N  run N workers, each with its own SO_REUSEPORT socket\n"
+            "  -p    pin worker i to cpu i\n"
+            "  -s N  pipe capacity in bytes (F_SETPIPE_SZ)\n"
+            "  -b N  bytes per splice call, default 16384\n"
+            "  -a    grow chunk and pipe of busy connections\n"
+            "  -w N  keep N idle backend connections per worker\n"
+            "  -B host:port  one more backend, may be repeated\n"
+            "  -L rr|lc|hash  round-robin, least connections or client\n"
+            "        address hash, default rr\n"
+            "  -I N  probe backends every N seconds, 0 disables, default 2\n"
+            "  -S path  serve statistics on this Unix socket\n"
+            "  -u    io_uring data path, epoll if the kernel lacks it\n"
+            "  -l N  listen backlog, default SOMAXCONN\n"
+            "  -D N  TCP_DEFER_ACCEPT: wake up only once the client sent\n"
+            "        data, give up after N seconds\n"
+            "  -c N  recv/send instead of splice while reads stay under\n"
+            "        N bytes, 0 disables, default 4096\n"
+            "  -U    forward UDP datagrams, -w and -I do not apply\n"
+            "  -i N  close a pair idle in both directions for N ms,\n"
+            "        default 5000\n"
+            "  -C N  give a backend connect N ms, default 5000\n"
+            "  -T N  close any pair N ms after it opened, default never\n"
+            "        0 turns -i, -C or -T off\n");
+    exit(1);
+}
+
+void add_backend(char *name, char *port)
+{
+    if (num_backends == MAX_BACKENDS) {
+        fprintf(stderr, "proxy: too many backends\n");
+        exit(1);
+    }
+    struct backend *b = &backends[num_backends++];
+    if (asprintf(&b->name, "%s:%s", name, port) < 0)
+        err("asprintf");
+    b->addr = resolve(name, port, 0);
+}
+
+/* host:port, the last colon separates so [v6]:port works too */
+void parse_backend(char *arg)
+{
+    char *colon = strrchr(arg, ':');
+    if (!colon || colon == arg)
+        usage();
+    *colon = '\0';
+    if (arg[0] == '[' && colon[-1] == ']') {
+        colon[-1] = '\0';
+        arg++;
+    }
+    add_backend(arg, colon + 1);
+}
+
+int main(int ac, char **av)
+{
+    char *extra[MAX_BACKENDS];
+    int num_extra = 0;
+
+    int opt;
+    while ((opt = getopt(ac, av, "j:ps:b:aw:B:L:I:S:ul:D:c:Ui:C:T:")) != -1) {
+        switch (opt) {
+        case 'j':
+            num_workers = atoi(optarg);
+            if (num_workers < 1)
+                usage();
+            break;
+        case 'p':
+            pin_workers = true;
+            break;
+        case 's':
+            pipe_size = atoi(optarg);
+            if (pipe_size < 0)
+                usage();
+            break;
+        case 'b':
+            splice_chunk = atoi(optarg);
+            if (splice_chunk < 1)
+                usage();
+            break;
+        case 'a':
+            adapt_pipes = true;
+            break;
+        case 'w':
+            warm_size = atoi(optarg);
+            if (warm_size < 0)
+                usage();
+            break;
+        case 'B':
+            if (num_extra == MAX_BACKENDS - 1)
+                usage();
+            extra[num_extra++] = optarg;
+            break;
+        case 'L':
+            if (!strcmp(optarg, "rr"))
+                lb_policy = LB_ROUND_ROBIN;
+            else if (!strcmp(optarg, "lc"))
+                lb_policy = LB_LEAST_CONN;
+            else if (!strcmp(optarg, "hash"))
+                lb_policy = LB_HASH;
+            else
+                usage();
+            break;
+        case 'I':
+            probe_interval = atoi(optarg);
+            if (probe_interval < 0)
+                usage();
+            break;
+        case 'S':
+            admin_path = optarg;
+            break;
+        case 'u':
+            use_uring = true;
+            break;
+        case 'l':
+            listen_backlog = atoi(optarg);
+            if (listen_backlog < 1)
+                usage();
+            break;
+        case 'U':
+            udp_mode = true;
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0)
+                usage();
+            break;
+        case 'C':
+            connect_timeout = atoi(optarg);
+            if (connect_timeout < 0)
+                usage();
+            break;
+        case 'T':
+            lifetime_timeout = atoi(optarg);
+            if (lifetime_timeout < 0)
+                usage();
+            break;
+        case 'c':
+            copy_size = atoi(optarg);
+            if (copy_size < 0 || copy_size > COPY_MAX)
+                usage();
+            break;
+        case 'D':
+            defer_accept = atoi(optarg);
+            if (defer_accept < 0)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    ac -= optind;
+    av += optind;
+    if (ac != 3 && ac != 4)
+        usage();
+
+    add_backend(av[1], av[2]);
+    for (int i = 0; i < num_extra; i++)
+        parse_backend(extra[i]);
+    listen_name = ac == 4 ? av[3] : "0.0.0.0";
+    listen_port = av[0];
+
+    int probe[2];
+    if (pipe(probe) < 0)
+        err("pipe");
+    pipe_capacity = size_pipe(probe[1]);
+    if (pipe_capacity < 0)
+        err("F_GETPIPE_SZ");
+    if (pipe_capacity < pipe_size)
+        fprintf(stderr, "proxy: pipes hold %d bytes, not %d\n", pipe_capacity,
+                pipe_size);
+    close(probe[0]);
+    close(probe[1]);
+
+    workers = calloc(num_workers, sizeof(*workers));
+    if (!workers)
+        err("calloc");
+
+    /* bind every socket up front, so errors show before serving */
+    for (int i = 0; i < num_workers; i++) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        wheel_init(w);
+        INIT_LIST_HEAD(&w->warm_list);
+        INIT_LIST_HEAD(&w->dead_list);
+        if (copy_size && !(w->scratch = malloc(COPY_MAX)))
+            err("malloc");
+        w->efd = epoll_create(10);
+        if (w->efd < 0)
+            err("epoll_create");
+        w->lfd = listen_socket(w, listen_name, listen_port);
+    }
+
+    void *(*loop)(void *) = worker_loop;
+    for (int i = 0; udp_mode && i < num_workers; i++) {
+        udp_setup(&workers[i]);
+        loop = udp_loop;
+    }
+    for (int i = 0; use_uring && !udp_mode && i < num_workers; i++) {
+        NEW(workers[i].ring);
+        if (!workers[i].ring || uring_setup(workers[i].ring) < 0) {
+            perror("proxy: io_uring unavailable, using epoll");
+            break;
+        }
+        if (i == num_workers - 1)
+            loop = uring_loop;
+    }
+
+    pthread_t admin;
+    if (admin_path && pthread_create(&admin, NULL, admin_loop, NULL))
+        err("pthread_create");
+
+    for (int i = 1; i < num_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, loop, &workers[i]))
+            err("pthread_create");
     }
+    loop(&workers[0]);
     return 0;
 }
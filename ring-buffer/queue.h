@@ -2,6 +2,7 @@
 #define queue_h_
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <linux/memfd.h>
 
@@ -22,9 +23,14 @@ typedef struct {
     // sequence number of last written message
     size_t tail_seq;
 
-    // synchronization primitives
-    pthread_cond_t readable, writeable;
+    // synchronization primitives: the lock guards the indices and the
+    // sleeper counts, the futex words are bumped whenever a message is
+    // added or consumed
     pthread_mutex_t lock;
+    uint32_t readable __attribute__((aligned(64)));
+    uint32_t read_waiters;
+    uint32_t writeable __attribute__((aligned(64)));
+    uint32_t write_waiters;
 } queue_t;
 
 #include <errno.h>
@@ -35,8 +41,11 @@ typedef struct {
 #include <string.h>
 #include <unistd.h>
 
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* Metadata (header) for a message in the queue */
 typedef struct {
@@ -65,14 +74,84 @@ static inline void queue_error_errno(const char *fmt, ...)
     abort();
 }
 
-/** Initialize a blocking queue *q* of size *s* */
-void queue_init(queue_t *q, size_t s)
+/* Spins before sleeping on a futex */
+#define QUEUE_SPINS 128
+
+static inline void queue_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void queue_futex_wait(uint32_t *word, uint32_t val)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void queue_futex_wake(uint32_t *word, int n)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Called locked, once the queue is not in the state we want: drop the
+ * lock until *word* moves, spinning a little before going to sleep, and
+ * take it again. Every change to the indices bumps the word under the
+ * lock, so a change can't be missed. Sleepers are counted under the lock
+ * and the waker takes them off the count, so each one costs one wakeup */
+static void queue_wait(queue_t *q, uint32_t *word, uint32_t *waiters)
+{
+    uint32_t val = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&q->lock);
+
+    for (int i = 0; i < QUEUE_SPINS; i++) {
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) != val)
+            goto out;
+        queue_cpu_relax();
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) != val)
+        return;
+    (*waiters)++;
+    pthread_mutex_unlock(&q->lock);
+
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == val)
+        queue_futex_wait(word, val);
+
+out:
+    pthread_mutex_lock(&q->lock);
+}
+
+/* Called locked, right after changing the indices: bump *word* and wake
+ * up to *n* of the threads asleep on it, if there are any */
+static void queue_signal(uint32_t *word, uint32_t *waiters, size_t n)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+    if (*waiters) {
+        if (n > *waiters)
+            n = *waiters;
+        *waiters -= n;
+        queue_futex_wake(word, n);
+    }
+}
+
+/** Map *s* bytes of fresh memory twice, back to back, and return the
+ * address of the first copy. The memfd backing it goes to *fd*.
+ */
+uint8_t *queue_map(size_t s, int *fd)
 {
     /* We mmap two adjacent pages (in virtual memory) that point to the same
      * physical memory. This lets us optimize memory access, so that we don't
      * need to even worry about wrapping our pointers around until we go
      * through the entire buffer.
      */
+    uint8_t *buffer;
 
     // Check that the requested size is a multiple of a page. If it isn't, we're
     // in trouble.
@@ -83,35 +162,54 @@ void queue_init(queue_t *q, size_t s)
     }
 
     // Create an anonymous file backed by memory
-    if ((q->fd = memfd_create("queue_region", 0)) == -1)
+    if ((*fd = memfd_create("queue_region", 0)) == -1)
         queue_error_errno("Could not obtain anonymous file");
 
     // Set buffer size
-    if (ftruncate(q->fd, s) != 0)
+    if (ftruncate(*fd, s) != 0)
         queue_error_errno("Could not set size of anonymous file");
 
     // Ask mmap for a good address
-    if ((q->buffer = mmap(NULL, 2 * s, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
-                          -1, 0)) == MAP_FAILED)
+    if ((buffer = mmap(NULL, 2 * s, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                       0)) == MAP_FAILED)
         queue_error_errno("Could not allocate virtual memory");
 
     // Mmap first region
-    if (mmap(q->buffer, s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
-             q->fd, 0) == MAP_FAILED)
+    if (mmap(buffer, s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, *fd,
+             0) == MAP_FAILED)
         queue_error_errno("Could not map buffer into virtual memory");
 
     // Mmap second region, with exact address
-    if (mmap(q->buffer + s, s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
-             q->fd, 0) == MAP_FAILED)
+    if (mmap(buffer + s, s, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             *fd, 0) == MAP_FAILED)
         queue_error_errno("Could not map buffer into virtual memory");
 
+    return buffer;
+}
+
+/** Undo queue_map() */
+void queue_unmap(uint8_t *buffer, size_t s, int fd)
+{
+    if (munmap(buffer + s, s) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (munmap(buffer, s) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (close(fd) != 0)
+        queue_error_errno("Could not close anonymous file");
+}
+
+/** Initialize a blocking queue *q* of size *s* */
+void queue_init(queue_t *q, size_t s)
+{
+    q->buffer = queue_map(s, &q->fd);
+
     // Initialize synchronization primitives
     if (pthread_mutex_init(&q->lock, NULL) != 0)
         queue_error_errno("Could not initialize mutex");
-    if (pthread_cond_init(&q->readable, NULL) != 0)
-        queue_error_errno("Could not initialize condition variable");
-    if (pthread_cond_init(&q->writeable, NULL) != 0)
-        queue_error_errno("Could not initialize condition variable");
+    q->readable = q->writeable = 0;
+    q->read_waiters = q->write_waiters = 0;
 
     // Initialize remaining members
     q->size = s;
@@ -122,51 +220,167 @@ void queue_init(queue_t *q, size_t s)
 /** Destroy the blocking queue *q* */
 void queue_destroy(queue_t *q)
 {
-    if (munmap(q->buffer + q->size, q->size) != 0)
-        queue_error_errno("Could not unmap buffer");
-
-    if (munmap(q->buffer, q->size) != 0)
-        queue_error_errno("Could not unmap buffer");
-
-    if (close(q->fd) != 0)
-        queue_error_errno("Could not close anonymous file");
+    queue_unmap(q->buffer, q->size, q->fd);
 
     if (pthread_mutex_destroy(&q->lock) != 0)
         queue_error_errno("Could not destroy mutex");
-
-    if (pthread_cond_destroy(&q->readable) != 0)
-        queue_error_errno("Could not destroy condition variable");
-
-    if (pthread_cond_destroy(&q->writeable) != 0)
-        queue_error_errno("Could not destroy condition variable");
 }
 
-/** Insert into queue *q* a message of *size* bytes from *buffer*
+/** Reserve room for a message of up to *size* bytes in queue *q* and
+ * return where to write it, contiguous thanks to the double mapping.
  *
- * Blocks until sufficient space is available in the queue.
+ * Blocks until sufficient space is available in the queue. The queue stays
+ * locked until queue_commit().
  */
-void queue_put(queue_t *q, uint8_t *buffer, size_t size)
+uint8_t *queue_reserve(queue_t *q, size_t size)
 {
     pthread_mutex_lock(&q->lock);
 
     // Wait for space to become available
     while ((q->size - (q->tail - q->head)) < (size + sizeof(message_t)))
-        pthread_cond_wait(&q->writeable, &q->lock);
+        queue_wait(q, &q->writeable, &q->write_waiters);
+
+    return &q->buffer[q->tail + sizeof(message_t)];
+}
 
+/* Write the header of the message of size bytes at tail and move past it */
+static void queue_append(queue_t *q, size_t size)
+{
     // Construct header
     message_t m = {.len = size, .seq = q->tail_seq++};
-
-    // Write message
     memcpy(&q->buffer[q->tail], &m, sizeof(message_t));
-    memcpy(&q->buffer[q->tail + sizeof(m)], buffer, size);
 
     // Increment write index
     q->tail += sizeof(m) + size;
+}
 
-    pthread_cond_signal(&q->readable);
+/** Publish the message written since queue_reserve(), *size* bytes long
+ * and no longer than what was reserved.
+ */
+void queue_commit(queue_t *q, size_t size)
+{
+    queue_append(q, size);
+
+    queue_signal(&q->readable, &q->read_waiters, 1);
     pthread_mutex_unlock(&q->lock);
 }
 
+/** Insert into queue *q* a message of *size* bytes from *buffer*
+ *
+ * Blocks until sufficient space is available in the queue.
+ */
+void queue_put(queue_t *q, uint8_t *buffer, size_t size)
+{
+    memcpy(queue_reserve(q, size), buffer, size);
+    queue_commit(q, size);
+}
+
+/** Insert into queue *q* the *n* messages described by *iov*, in order
+ *
+ * Takes the lock once and wakes consumers once for the whole batch, or
+ * each time it has to wait for space on the way.
+ */
+void queue_put_batch(queue_t *q, const struct iovec *iov, size_t n)
+{
+    size_t added = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    for (size_t i = 0; i < n; i++) {
+        size_t size = iov[i].iov_len;
+
+        // Let consumers at what we have so far while we wait for space
+        while ((q->size - (q->tail - q->head)) < (size + sizeof(message_t))) {
+            if (added) {
+                queue_signal(&q->readable, &q->read_waiters, added);
+                added = 0;
+            }
+            queue_wait(q, &q->writeable, &q->write_waiters);
+        }
+
+        memcpy(&q->buffer[q->tail + sizeof(message_t)], iov[i].iov_base, size);
+        queue_append(q, size);
+        added++;
+    }
+
+    if (added)
+        queue_signal(&q->readable, &q->read_waiters, added);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/** Return the message at the front of queue *q* in place, its length
+ * goes to *len*.
+ *
+ * Blocks until a message is available. The queue stays locked until
+ * queue_release().
+ */
+uint8_t *queue_peek(queue_t *q, size_t *len)
+{
+    pthread_mutex_lock(&q->lock);
+
+    // Wait for a message to arrive
+    while ((q->tail - q->head) == 0)
+        queue_wait(q, &q->readable, &q->read_waiters);
+
+    message_t m;
+    memcpy(&m, &q->buffer[q->head], sizeof(message_t));
+    *len = m.len;
+    return &q->buffer[q->head + sizeof(message_t)];
+}
+
+/* Move head past the message at the front of the queue */
+static void queue_advance(queue_t *q)
+{
+    message_t m;
+    memcpy(&m, &q->buffer[q->head], sizeof(message_t));
+
+    // Consume the message by incrementing the read pointer
+    q->head += m.len + sizeof(message_t);
+    q->head_seq++;
+
+    // When read buffer moves into 2nd memory region, we can reset to the 1st
+    // region
+    if (q->head >= q->size) {
+        q->head -= q->size;
+        q->tail -= q->size;
+    }
+}
+
+/** Consume the message handed out by queue_peek() */
+void queue_release(queue_t *q)
+{
+    queue_advance(q);
+
+    queue_signal(&q->writeable, &q->write_waiters, INT32_MAX);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Wait, locked, for a message of at most max bytes to reach the front of
+ * the queue and read its header into m */
+static void queue_wait_message(queue_t *q, size_t max, message_t *m)
+{
+    for (;;) {
+        // Wait for a message to arrive
+        while ((q->tail - q->head) == 0)
+            queue_wait(q, &q->readable, &q->read_waiters);
+
+        // Read message header
+        memcpy(m, &q->buffer[q->head], sizeof(message_t));
+
+        // Message too long, pass the wakeup on to another reader and wait
+        // for someone else to consume it
+        if (m->len > max) {
+            queue_signal(&q->readable, &q->read_waiters, 1);
+            while (q->head_seq == m->seq)
+                queue_wait(q, &q->writeable, &q->write_waiters);
+            continue;
+        }
+
+        // We successfully consumed the header of a suitable message
+        return;
+    }
+}
+
 /** Retrieves a message of at most *max* bytes from queue *q* and writes
  * it to *buffer*.
  *
@@ -181,43 +395,342 @@ size_t queue_get(queue_t *q, uint8_t *buffer, size_t max)
     // Wait for a message that we can successfully consume to reach the front of
     // the queue
     message_t m;
+    queue_wait_message(q, max, &m);
+
+    // Read message body
+    memcpy(buffer, &q->buffer[q->head + sizeof(message_t)], m.len);
+
+    queue_release(q);
+
+    return m.len;
+}
+
+/** Retrieves up to *n* messages from queue *q* into the buffers of *bufs*,
+ * the i-th message going to bufs[i] and its length to bufs[i].iov_len.
+ *
+ * Blocks until the first message fits in bufs[0], then takes whatever
+ * follows without waiting, stopping at a message too long for its buffer.
+ * Takes the lock once and wakes producers once for the whole batch.
+ *
+ * Returns the number of messages written.
+ */
+size_t queue_get_batch(queue_t *q, struct iovec *bufs, size_t n)
+{
+    size_t i;
+    message_t m;
+
+    if (n == 0)
+        return 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    queue_wait_message(q, bufs[0].iov_len, &m);
+
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            if (q->tail == q->head)
+                break;
+            memcpy(&m, &q->buffer[q->head], sizeof(message_t));
+            if (m.len > bufs[i].iov_len)
+                break;
+        }
+        memcpy(bufs[i].iov_base, &q->buffer[q->head + sizeof(message_t)],
+               m.len);
+        bufs[i].iov_len = m.len;
+        queue_advance(q);
+    }
+
+    queue_signal(&q->writeable, &q->write_waiters, INT32_MAX);
+    pthread_mutex_unlock(&q->lock);
+
+    return i;
+}
+
+/* Lock-free multi-producer, multi-consumer variant over the same double
+ * mapping.
+ *
+ * Positions only ever grow; position p lives at offset p % size, and the
+ * mirror keeps every message contiguous. Producers claim space by moving
+ * tail forward with a CAS, fill it in, then commit by storing the message
+ * position into its header. Consumers claim a committed message by moving
+ * head past it with a CAS, copy it out and mark the header consumed. The
+ * space behind a message is handed back to producers (reclaim moves on)
+ * only once it and every message before it were consumed, whoever marks
+ * the oldest one walks reclaim over the run. Threads only sleep on a
+ * futex when the queue is empty or full, and are only woken when one is
+ * registered as waiting.
+ *
+ * A thread holding a stale head or reclaim may read a header the space of
+ * which was reused meanwhile, seqlock style. Whatever it finds there, the
+ * CAS on the index it read fails and it starts over. A consumer at an
+ * up to date head only trusts the header because releasing a message
+ * zeroes its payload, so free space never holds a committed look-alike.
+ */
+typedef struct {
+    // backing buffer and size
+    uint8_t *buffer;
+    size_t size;
+
+    // backing buffer's memfd descriptor
+    int fd;
+
+    // next position to claim by producers, by consumers, and the oldest
+    // position still in use
+    size_t tail __attribute__((aligned(64)));
+    size_t head __attribute__((aligned(64)));
+    size_t reclaim __attribute__((aligned(64)));
+
+    // futex words, bumped on every commit and every reclaim, and the
+    // number of threads asleep on each
+    uint32_t readable __attribute__((aligned(64)));
+    uint32_t read_waiters;
+    uint32_t writeable __attribute__((aligned(64)));
+    uint32_t write_waiters;
+} mpmc_queue_t;
+
+/* Header of an MPMC message, state is position * 4 plus one of these */
+typedef struct {
+    size_t state, len;
+} mpmc_message_t;
+
+enum { MPMC_RESERVED, MPMC_COMMITTED, MPMC_CONSUMED };
+
+static inline size_t mpmc_space(size_t len)
+{
+    return (sizeof(mpmc_message_t) + len + 7) & ~(size_t) 7;
+}
+
+static inline mpmc_message_t *mpmc_header(mpmc_queue_t *q, size_t pos)
+{
+    return (mpmc_message_t *) &q->buffer[pos % q->size];
+}
+
+/* Wait on *word* until *ready* holds: spin a little, then sleep, with
+ * the waiter count raised so the other side knows to wake us */
+static inline void mpmc_wait(uint32_t *word,
+                             uint32_t *waiters,
+                             bool (*ready)(mpmc_queue_t *, void *),
+                             mpmc_queue_t *q,
+                             void *arg)
+{
+    for (int i = 0; i < QUEUE_SPINS; i++) {
+        if (ready(q, arg))
+            return;
+        queue_cpu_relax();
+    }
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
     for (;;) {
-        // Wait for a message to arrive
-        while ((q->tail - q->head) == 0)
-            pthread_cond_wait(&q->readable, &q->lock);
+        uint32_t val = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+        if (ready(q, arg))
+            break;
+        queue_futex_wait(word, val);
+    }
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
 
-        // Read message header
-        memcpy(&m, &q->buffer[q->head], sizeof(message_t));
+static inline void mpmc_signal(uint32_t *word, uint32_t *waiters)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+        queue_futex_wake(word, INT32_MAX);
+}
 
-        // Message too long, wait for someone else to consume it
-        if (m.len > max) {
-            while (q->head_seq == m.seq)
-                pthread_cond_wait(&q->writeable, &q->lock);
+/** Initialize a lock-free queue *q* of size *s* */
+void mpmc_queue_init(mpmc_queue_t *q, size_t s)
+{
+    q->buffer = queue_map(s, &q->fd);
+    q->size = s;
+    q->tail = q->head = q->reclaim = 0;
+    q->readable = q->writeable = 0;
+    q->read_waiters = q->write_waiters = 0;
+}
+
+/** Destroy the lock-free queue *q* */
+void mpmc_queue_destroy(mpmc_queue_t *q)
+{
+    queue_unmap(q->buffer, q->size, q->fd);
+}
+
+static bool mpmc_has_room(mpmc_queue_t *q, void *arg)
+{
+    size_t need = *(size_t *) arg;
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+    size_t reclaim = __atomic_load_n(&q->reclaim, __ATOMIC_SEQ_CST);
+    return tail + need - reclaim <= q->size;
+}
+
+/** Reserve room for a message of *size* bytes in queue *q* and return
+ * where to write it.
+ *
+ * Blocks until sufficient space is available in the queue. Other producers
+ * and consumers go on meanwhile, consumers stop at the message until
+ * mpmc_queue_commit().
+ */
+uint8_t *mpmc_queue_reserve(mpmc_queue_t *q, size_t size)
+{
+    size_t need = mpmc_space(size);
+    if (need > q->size)
+        queue_error("Message (%lu) does not fit the queue (%lu)", size,
+                    q->size);
+
+    // Claim [tail, tail + need)
+    size_t tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+    for (;;) {
+        size_t reclaim = __atomic_load_n(&q->reclaim, __ATOMIC_SEQ_CST);
+        if (tail + need - reclaim > q->size) {
+            mpmc_wait(&q->writeable, &q->write_waiters, mpmc_has_room, q,
+                      &need);
+            tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
             continue;
         }
+        if (__atomic_compare_exchange_n(&q->tail, &tail, tail + need, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+    }
+
+    mpmc_message_t *m = mpmc_header(q, tail);
+    __atomic_store_n(&m->len, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&m->state, tail * 4 + MPMC_RESERVED, __ATOMIC_RELAXED);
+    return (uint8_t *) (m + 1);
+}
+
+/** Publish the message at *msg*, as returned by mpmc_queue_reserve() */
+void mpmc_queue_commit(mpmc_queue_t *q, uint8_t *msg)
+{
+    mpmc_message_t *m = (mpmc_message_t *) msg - 1;
+    size_t pos = __atomic_load_n(&m->state, __ATOMIC_RELAXED) / 4;
+    __atomic_store_n(&m->state, pos * 4 + MPMC_COMMITTED, __ATOMIC_RELEASE);
+
+    mpmc_signal(&q->readable, &q->read_waiters);
+}
+
+/** Insert into queue *q* a message of *size* bytes from *buffer*
+ *
+ * Blocks until sufficient space is available in the queue.
+ */
+void mpmc_queue_put(mpmc_queue_t *q, uint8_t *buffer, size_t size)
+{
+    uint8_t *msg = mpmc_queue_reserve(q, size);
+    memcpy(msg, buffer, size);
+    mpmc_queue_commit(q, msg);
+}
+
+/* Hand the space of consumed messages from reclaim onward back to the
+ * producers. Stops at the first message still being read, whoever
+ * finishes that one carries on from there */
+static void mpmc_reclaim(mpmc_queue_t *q)
+{
+    size_t pos = __atomic_load_n(&q->reclaim, __ATOMIC_SEQ_CST);
+    bool moved = false;
 
-        // We successfully consumed the header of a suitable message, so proceed
-        break;
+    for (;;) {
+        mpmc_message_t *m = mpmc_header(q, pos);
+        if (__atomic_load_n(&m->state, __ATOMIC_SEQ_CST) !=
+            pos * 4 + MPMC_CONSUMED)
+            break;
+        size_t next = pos + mpmc_space(__atomic_load_n(&m->len,
+                                                       __ATOMIC_RELAXED));
+        // Lost the race, the winner went on from here
+        if (!__atomic_compare_exchange_n(&q->reclaim, &pos, next, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+        pos = next;
+        moved = true;
     }
+    if (moved)
+        mpmc_signal(&q->writeable, &q->write_waiters);
+}
 
-    // Read message body
-    memcpy(buffer, &q->buffer[q->head + sizeof(message_t)], m.len);
+/* Committed message at head, or someone else took head meanwhile */
+static bool mpmc_head_ready(mpmc_queue_t *q, void *arg)
+{
+    size_t head = *(size_t *) arg;
+    mpmc_message_t *m = mpmc_header(q, head);
+    return __atomic_load_n(&m->state, __ATOMIC_ACQUIRE) ==
+               head * 4 + MPMC_COMMITTED ||
+           __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) != head;
+}
 
-    // Consume the message by incrementing the read pointer
-    q->head += m.len + sizeof(message_t);
-    q->head_seq++;
+static bool mpmc_head_moved(mpmc_queue_t *q, void *arg)
+{
+    return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) != *(size_t *) arg;
+}
 
-    // When read buffer moves into 2nd memory region, we can reset to the 1st
-    // region
-    if (q->head >= q->size) {
-        q->head -= q->size;
-        q->tail -= q->size;
+/* Take the message at head once it is committed and no longer than max */
+static mpmc_message_t *mpmc_claim(mpmc_queue_t *q, size_t max)
+{
+    size_t head, len;
+    mpmc_message_t *m;
+
+    for (;;) {
+        head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+        m = mpmc_header(q, head);
+
+        // Empty, or its producer has not committed yet
+        if (__atomic_load_n(&m->state, __ATOMIC_ACQUIRE) !=
+            head * 4 + MPMC_COMMITTED) {
+            mpmc_wait(&q->readable, &q->read_waiters, mpmc_head_ready, q,
+                      &head);
+            continue;
+        }
+
+        // The header is only trusted if head did not move past it
+        len = __atomic_load_n(&m->len, __ATOMIC_RELAXED);
+
+        // Message too long, wait for someone else to consume it
+        if (len > max) {
+            mpmc_wait(&q->writeable, &q->write_waiters, mpmc_head_moved, q,
+                      &head);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&q->head, &head,
+                                        head + mpmc_space(len), false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return m;
     }
+}
 
-    pthread_cond_signal(&q->writeable);
-    pthread_mutex_unlock(&q->lock);
+/** Take the message at the front of queue *q* and return it in place, its
+ * length goes to *len*.
+ *
+ * Blocks until a message is available. Other consumers go on with the
+ * messages behind it, its space is not reused before mpmc_queue_release().
+ */
+uint8_t *mpmc_queue_peek(mpmc_queue_t *q, size_t *len)
+{
+    mpmc_message_t *m = mpmc_claim(q, SIZE_MAX);
+    *len = m->len;
+    return (uint8_t *) (m + 1);
+}
 
-    return m.len;
+/** Hand back the message at *msg*, as returned by mpmc_queue_peek() */
+void mpmc_queue_release(mpmc_queue_t *q, uint8_t *msg)
+{
+    mpmc_message_t *m = (mpmc_message_t *) msg - 1;
+    size_t pos = __atomic_load_n(&m->state, __ATOMIC_RELAXED) / 4;
+    // Later headers may land in the payload, leave nothing there that
+    // reads as committed. Only the old header stays, and neither its
+    // consumed state nor its len can pass for one
+    memset(msg, 0, mpmc_space(m->len) - sizeof(*m));
+    __atomic_store_n(&m->state, pos * 4 + MPMC_CONSUMED, __ATOMIC_SEQ_CST);
+    mpmc_reclaim(q);
+}
+
+/** Retrieves a message of at most *max* bytes from queue *q* and writes
+ * it to *buffer*.
+ *
+ * Blocks until a message of no more than *max* bytes is available.
+ *
+ * Returns the number of bytes in the written message.
+ */
+size_t mpmc_queue_get(mpmc_queue_t *q, uint8_t *buffer, size_t max)
+{
+    mpmc_message_t *m = mpmc_claim(q, max);
+    size_t len = m->len;
+    memcpy(buffer, m + 1, len);
+    mpmc_queue_release(q, (uint8_t *) (m + 1));
+    return len;
 }
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "queue.h"
@@ -6,6 +7,14 @@
 #define BUFFER_SIZE (getpagesize())
 #define NUM_THREADS (8)
 #define MESSAGES_PER_THREAD (getpagesize() * 2)
+#define NUM_PUBLISHERS (4)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 static void *consumer_loop(void *arg)
 {
@@ -28,6 +37,309 @@ static void *publisher_loop(void *arg)
     return (void *) i;
 }
 
+/* Every value sent once, in messages of 8 to 64 bytes so they straddle
+ * the end of the buffer in all kinds of ways */
+static size_t mpmc_sum;
+
+static void *mpmc_consumer_loop(void *arg)
+{
+    mpmc_queue_t *q = (mpmc_queue_t *) arg;
+    size_t count = 0, sum = 0;
+    int total = NUM_PUBLISHERS * MESSAGES_PER_THREAD;
+    for (int i = 0; i < total / NUM_THREADS; i++) {
+        size_t x[8];
+        size_t len = mpmc_queue_get(q, (uint8_t *) x, sizeof(x));
+        if (len != (x[0] % 8 + 1) * sizeof(size_t) ||
+            x[len / sizeof(size_t) - 1] != x[0])
+            queue_error("Corrupt message %lu of %lu bytes", x[0], len);
+        sum += x[0];
+        count++;
+    }
+    __atomic_add_fetch(&mpmc_sum, sum, __ATOMIC_RELAXED);
+    return (void *) count;
+}
+
+static void *mpmc_publisher_loop(void *arg)
+{
+    mpmc_queue_t *q = ((void **) arg)[0];
+    size_t id = (intptr_t)((void **) arg)[1];
+    size_t i;
+    for (i = 0; (int) i < MESSAGES_PER_THREAD; i++) {
+        size_t x[8], v = id * MESSAGES_PER_THREAD + i;
+        for (int k = 0; k < 8; k++)
+            x[k] = v;
+        mpmc_queue_put(q, (uint8_t *) x, (v % 8 + 1) * sizeof(size_t));
+    }
+    return (void *) i;
+}
+
+static int test_mpmc(void)
+{
+    mpmc_queue_t q;
+    mpmc_queue_init(&q, BUFFER_SIZE);
+
+    pthread_t publishers[NUM_PUBLISHERS];
+    pthread_t consumers[NUM_THREADS];
+    void *args[NUM_PUBLISHERS][2];
+
+    double start = now();
+    for (intptr_t i = 0; i < NUM_PUBLISHERS; i++) {
+        args[i][0] = &q;
+        args[i][1] = (void *) i;
+        pthread_create(&publishers[i], NULL, &mpmc_publisher_loop, args[i]);
+    }
+    for (intptr_t i = 0; i < NUM_THREADS; i++)
+        pthread_create(&consumers[i], NULL, &mpmc_consumer_loop, &q);
+
+    intptr_t sent = 0, recd = 0;
+    for (intptr_t i = 0; i < NUM_PUBLISHERS; i++) {
+        intptr_t n;
+        pthread_join(publishers[i], (void **) &n);
+        sent += n;
+    }
+    for (intptr_t i = 0; i < NUM_THREADS; i++) {
+        intptr_t n;
+        pthread_join(consumers[i], (void **) &n);
+        recd += n;
+    }
+    double elapsed = now() - start;
+
+    size_t total = NUM_PUBLISHERS * MESSAGES_PER_THREAD;
+    printf("mpmc: %d publishers sent %ld, %d consumers received %ld "
+           "messages in %.3f s\n",
+           NUM_PUBLISHERS, sent, NUM_THREADS, recd, elapsed);
+
+    mpmc_queue_destroy(&q);
+
+    if ((size_t) recd != total || mpmc_sum != total * (total - 1) / 2) {
+        printf("mpmc: lost or duplicated messages\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Messages built and parsed in place, reserved at full size but
+ * committed shorter on the locked queue */
+static void *zc_publisher_loop(void *arg)
+{
+    queue_t *q = (queue_t *) arg;
+    size_t i;
+    for (i = 0; (int) i < MESSAGES_PER_THREAD; i++) {
+        size_t *x = (size_t *) queue_reserve(q, 8 * sizeof(size_t));
+        size_t n = i % 8 + 1;
+        for (size_t k = 0; k < n; k++)
+            x[k] = i;
+        queue_commit(q, n * sizeof(size_t));
+    }
+    return (void *) i;
+}
+
+static void *zc_mpmc_publisher_loop(void *arg)
+{
+    mpmc_queue_t *q = ((void **) arg)[0];
+    size_t id = (intptr_t)((void **) arg)[1];
+    size_t i;
+    for (i = 0; (int) i < MESSAGES_PER_THREAD; i++) {
+        size_t v = id * MESSAGES_PER_THREAD + i, n = v % 8 + 1;
+        size_t *x = (size_t *) mpmc_queue_reserve(q, n * sizeof(size_t));
+        for (size_t k = 0; k < n; k++)
+            x[k] = v;
+        mpmc_queue_commit(q, (uint8_t *) x);
+    }
+    return (void *) i;
+}
+
+static void *zc_mpmc_consumer_loop(void *arg)
+{
+    mpmc_queue_t *q = (mpmc_queue_t *) arg;
+    size_t sum = 0;
+    for (int i = 0; i < MESSAGES_PER_THREAD; i++) {
+        size_t len;
+        size_t *x = (size_t *) mpmc_queue_peek(q, &len);
+        if (len != (x[0] % 8 + 1) * sizeof(size_t) ||
+            x[len / sizeof(size_t) - 1] != x[0])
+            queue_error("Corrupt message %lu of %lu bytes", x[0], len);
+        sum += x[0];
+        mpmc_queue_release(q, (uint8_t *) x);
+    }
+    return (void *) sum;
+}
+
+static int test_zero_copy(void)
+{
+    int ret = 0;
+    queue_t q;
+    queue_init(&q, BUFFER_SIZE);
+
+    pthread_t publisher;
+    pthread_create(&publisher, NULL, &zc_publisher_loop, &q);
+    for (size_t i = 0; (int) i < MESSAGES_PER_THREAD; i++) {
+        size_t len;
+        size_t *x = (size_t *) queue_peek(&q, &len);
+        if (len != (i % 8 + 1) * sizeof(size_t) || x[0] != i ||
+            x[len / sizeof(size_t) - 1] != i)
+            ret = 1;
+        queue_release(&q);
+    }
+    pthread_join(publisher, NULL);
+    queue_destroy(&q);
+
+    mpmc_queue_t mq;
+    mpmc_queue_init(&mq, BUFFER_SIZE);
+
+    pthread_t publishers[2], consumers[2];
+    void *args[2][2];
+    for (intptr_t i = 0; i < 2; i++) {
+        args[i][0] = &mq;
+        args[i][1] = (void *) i;
+        pthread_create(&publishers[i], NULL, &zc_mpmc_publisher_loop, args[i]);
+        pthread_create(&consumers[i], NULL, &zc_mpmc_consumer_loop, &mq);
+    }
+    size_t sum = 0;
+    for (int i = 0; i < 2; i++) {
+        intptr_t n;
+        pthread_join(publishers[i], NULL);
+        pthread_join(consumers[i], (void **) &n);
+        sum += n;
+    }
+    mpmc_queue_destroy(&mq);
+
+    size_t total = 2 * MESSAGES_PER_THREAD;
+    if (sum != total * (total - 1) / 2)
+        ret = 1;
+
+    printf("zero-copy: %s\n", ret ? "corrupt or lost messages" : "ok");
+    return ret;
+}
+
+static void *stale_consumer_loop(void *arg)
+{
+    mpmc_queue_t *q = (mpmc_queue_t *) arg;
+    static size_t x[2];
+    if (mpmc_queue_get(q, (uint8_t *) x, sizeof(x)) != sizeof(size_t))
+        return NULL;
+    return (void *) x[0];
+}
+
+/* A drained queue whose next header lands in an old payload, one that
+ * looks like a message committed right there */
+static int test_mpmc_stale(void)
+{
+    mpmc_queue_t q;
+    mpmc_queue_init(&q, BUFFER_SIZE);
+
+    size_t big = BUFFER_SIZE - 2 * sizeof(mpmc_message_t);
+    size_t *x = calloc(1, big);
+    x[0] = (BUFFER_SIZE + 32) * 4 + MPMC_COMMITTED;
+    x[1] = sizeof(size_t);
+    mpmc_queue_put(&q, (uint8_t *) x, 0);
+    mpmc_queue_put(&q, (uint8_t *) x, big);
+    mpmc_queue_get(&q, (uint8_t *) x, big);
+    mpmc_queue_get(&q, (uint8_t *) x, big);
+    mpmc_queue_put(&q, (uint8_t *) x, 16);
+    mpmc_queue_get(&q, (uint8_t *) x, big);
+    free(x);
+
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, &stale_consumer_loop, &q);
+    usleep(100000);
+    size_t real = 42;
+    mpmc_queue_put(&q, (uint8_t *) &real, sizeof(real));
+    void *got;
+    pthread_join(consumer, &got);
+    mpmc_queue_destroy(&q);
+
+    int ret = (size_t) got != real;
+    printf("mpmc stale header: %s\n", ret ? "phantom message" : "ok");
+    return ret;
+}
+
+/* Batches of BATCH messages of 8 to 64 bytes, each consumer taking its
+ * share in batches too */
+#define BATCH (16)
+
+static size_t batch_sum;
+
+static void *batch_consumer_loop(void *arg)
+{
+    queue_t *q = (queue_t *) arg;
+    size_t count = 0, sum = 0;
+    while ((int) count < MESSAGES_PER_THREAD) {
+        size_t x[BATCH][8];
+        struct iovec bufs[BATCH];
+        size_t n = MESSAGES_PER_THREAD - count;
+        if (n > BATCH)
+            n = BATCH;
+        for (size_t k = 0; k < n; k++) {
+            bufs[k].iov_base = x[k];
+            bufs[k].iov_len = sizeof(x[k]);
+        }
+        n = queue_get_batch(q, bufs, n);
+        for (size_t k = 0; k < n; k++) {
+            size_t len = bufs[k].iov_len;
+            if (len != (x[k][0] % 8 + 1) * sizeof(size_t) ||
+                x[k][len / sizeof(size_t) - 1] != x[k][0])
+                queue_error("Corrupt message %lu of %lu bytes", x[k][0], len);
+            sum += x[k][0];
+        }
+        count += n;
+    }
+    __atomic_add_fetch(&batch_sum, sum, __ATOMIC_RELAXED);
+    return (void *) count;
+}
+
+static void *batch_publisher_loop(void *arg)
+{
+    queue_t *q = (queue_t *) arg;
+    size_t total = NUM_THREADS * MESSAGES_PER_THREAD, i;
+    for (i = 0; i < total; i += BATCH) {
+        size_t x[BATCH][8];
+        struct iovec iov[BATCH];
+        for (size_t k = 0; k < BATCH; k++) {
+            for (int j = 0; j < 8; j++)
+                x[k][j] = i + k;
+            iov[k].iov_base = x[k];
+            iov[k].iov_len = ((i + k) % 8 + 1) * sizeof(size_t);
+        }
+        queue_put_batch(q, iov, BATCH);
+    }
+    return (void *) i;
+}
+
+static int test_batch(void)
+{
+    queue_t q;
+    queue_init(&q, BUFFER_SIZE);
+
+    pthread_t publisher;
+    pthread_t consumers[NUM_THREADS];
+
+    double start = now();
+    pthread_create(&publisher, NULL, &batch_publisher_loop, &q);
+    for (intptr_t i = 0; i < NUM_THREADS; i++)
+        pthread_create(&consumers[i], NULL, &batch_consumer_loop, &q);
+
+    intptr_t sent, recd = 0;
+    pthread_join(publisher, (void **) &sent);
+    for (intptr_t i = 0; i < NUM_THREADS; i++) {
+        intptr_t n;
+        pthread_join(consumers[i], (void **) &n);
+        recd += n;
+    }
+
+    printf("batch: sent %ld, received %ld messages in %.3f s\n", sent, recd,
+           now() - start);
+
+    queue_destroy(&q);
+
+    size_t total = NUM_THREADS * MESSAGES_PER_THREAD;
+    if ((size_t) recd != total || batch_sum != total * (total - 1) / 2) {
+        printf("batch: lost or duplicated messages\n");
+        return 1;
+    }
+    return 0;
+}
+
 int main(void)
 {
     queue_t q;
@@ -39,6 +351,7 @@ int main(void)
     pthread_attr_t attr;
     pthread_attr_init(&attr);
 
+    double start = now();
     pthread_create(&publisher, &attr, &publisher_loop, (void *) &q);
 
     for (intptr_t i = 0; i < NUM_THREADS; i++)
@@ -54,9 +367,11 @@ int main(void)
         printf("consumer %ld received %ld messages\n", i, recd[i]);
     }
 
+    printf("locked queue took %.3f s\n", now() - start);
+
     pthread_attr_destroy(&attr);
 
     queue_destroy(&q);
 
-    return 0;
+    return test_mpmc() | test_mpmc_stale() | test_zero_copy() | test_batch();
 }